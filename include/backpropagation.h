@@ -3,7 +3,27 @@
 
 #include <neural_net.h>
 #include <vector.h>
+#include <matrix.h>
 
-Vector *backprop_calc_grad(Vector *single_gradient, Neural_Net *network, Vector *raw_node_values, Vector *node_values, Vector *expected_result);
+typedef struct
+{
+    Matrix dc_da;
+    Matrix dc_da_prev;
+    Matrix da_dz;
+} Backprop_Workspace;
+
+Backprop_Workspace backprop_workspace_malloc(Neural_Net *network, int batch_size);
+
+void backprop_workspace_free(Backprop_Workspace w);
+
+void backprop_calc_dc_dw(Matrix *dc_dw, Vector *a, Vector *da_dz, Vector *dc_da);
+
+void backprop_calc_dc_da(Vector *dc_da_prev, Matrix *w, Vector *da_dz, Vector *dc_da);
+
+void backprop_calc_layer(Matrix *dc_dw, Matrix *dc_da_prev, Matrix *w, Matrix *a_prev, Matrix *delta);
+
+Vector *backprop_calc_grad(Vector *gradient, Backprop_Workspace *workspace, Neural_Net *network, Vector *node_values, Vector *expected_result, Sparse_Vector *sparse, Matrix *sparse_dc_dw);
+
+Vector *backprop_calc_grad_batch(Vector *gradient, Backprop_Workspace *workspace, Neural_Net *network, Matrix *node_values, Matrix *expected_results, Sparse_Vector *sparse, Matrix *sparse_dc_dw);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,6 @@
+#ifndef BENCH_INCLUDE
+#define BENCH_INCLUDE
+
+int bench_run(const char *image_file, const char *label_file, int threads);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,22 @@
+#ifndef EVALUATE_INCLUDE
+#define EVALUATE_INCLUDE
+
+#include <neural_net.h>
+#include <image.h>
+
+typedef struct
+{
+    int count;
+    int correct;
+    int classes;
+    int *confusion;
+    double seconds;
+} Evaluation;
+
+Evaluation network_evaluate(Neural_Net *network, Dataset *dataset, int threads);
+
+void evaluation_free(Evaluation e);
+
+void evaluation_print(Evaluation *e);
+
+#endif
\ No newline at end of file
@@ -2,31 +2,57 @@
 #define IMAGE_INCLUDE
 
 #include <stdint.h>
+#include <stddef.h>
+#include <real.h>
+#include <random.h>
 
 typedef struct
 {
     int size;
-    double *data;
+    const uint8_t *data;
     int label;
+    int nonzero_count;
+    const int32_t *nonzero_indices;
+    const uint8_t *nonzero_values;
 } Image;
 
 typedef struct
 {
     int count;
     Image *images;
+    int *indices;
+    void *image_map;
+    size_t image_map_size;
+    void *label_map;
+    size_t label_map_size;
+    int32_t *sparse_indices;
+    uint8_t *sparse_values;
+    uint8_t *pixels;
 } Dataset;
 
-void image_free(Image i);
-
-void image_free_p(Image *i);
-
 void dataset_free(Dataset d);
 
 void dataset_free_p(Dataset *d);
 
+int32_t image_read_header(const uint8_t *header, int index);
+
 Dataset *image_load(const char *image_file, const char *label_file);
 
-void image_randomize_order(Dataset *dataset);
+int dataset_sparsify(Dataset *dataset);
+
+void image_convert(real *dest, const Image *image);
+
+int image_convert_sparse(real *dest, const Image *image);
+
+int dataset_check_labels(const Dataset *dataset, int classes);
+
+const Image *dataset_image(const Dataset *dataset, int i);
+
+int *dataset_order_malloc(const Dataset *dataset);
+
+void dataset_shuffle_order(int *order, int count, Rng *rng);
+
+Dataset *dataset_view(Dataset *dataset, int *order);
 
 Dataset *dataset_subset(Dataset *dataset, int offset, int count);
 
@@ -0,0 +1,27 @@
+#ifndef KERNEL_INCLUDE
+#define KERNEL_INCLUDE
+
+#include <real.h>
+#include <stdint.h>
+
+void kernel_init();
+
+real kernel_dot(const real *a, const real *b, int n);
+
+void kernel_dot4(real *dest, const real *a, int stride, const real *b, int n);
+
+void kernel_axpy(real *y, real scale, const real *x, int n);
+
+void kernel_outer_axpy4(real *dest, real *y, const real *x, const real *rows, int stride, const real *scales, int n);
+
+void kernel_matrix_axpy4(real *dest, const real *x, int stride, int count, const real *scales, int scale_stride, int scale_step, int n);
+
+void kernel_gather_axpy(real *y, const real *rows, int n, const int32_t *indices, const real *x, int count);
+
+void kernel_scatter_axpy(real *rows, int n, const int32_t *indices, const real *x, int count, const real *v);
+
+void kernel_sigmoid(real *dest, const real *src, int n);
+
+const char *kernel_name();
+
+#endif
\ No newline at end of file
@@ -0,0 +1,14 @@
+#ifndef LAYER_INCLUDE
+#define LAYER_INCLUDE
+
+#include <matrix.h>
+#include <vector.h>
+
+void layer_activate_rows(real *dest, const real *raw, int rows, int width, int softmax);
+
+void layer_forward(Matrix *raw, Matrix *dest, Matrix *input, Matrix *weights, Vector *biases, int softmax);
+
+void layer_forward_sparse(Matrix *raw, Matrix *dest, Sparse_Vector *input, Matrix *transposed, Vector *biases,
+                          int softmax);
+
+#endif
\ No newline at end of file
@@ -1,9 +1,13 @@
 #ifndef MATH_EXT_INCLUDE
 #define MATH_EXT_INCLUDE
 
+#include <real.h>
+
 #define MAX(x, y) (((x) > (y) ? (x) : (y)))
 #define MIN(x, y) (((x) < (y) ? (x) : (y)))
 
-double sigmoid(double x);
+real sigmoid(real x);
+
+int compare_doubles(const void *a, const void *b);
 
 #endif
\ No newline at end of file
@@ -1,21 +1,32 @@
 #ifndef MATRIX_INCLUDE
 #define MATRIX_INCLUDE
 
+#include <real.h>
+#include <random.h>
+
 typedef struct
 {
     int width;
     int height;
-    double *values;
+    real *values;
 } Matrix;
 
+Matrix matrix_error();
+
 Matrix matrix_malloc(int width, int height);
 
+Matrix matrix_malloc_aligned(int width, int height, int alignment);
+
 void matrix_free(Matrix m);
 
 void matrix_free_p(Matrix *m);
 
 char *matrix_to_string(const Matrix m);
 
-void matrix_fill_normal(Matrix *m, double std_dev);
+void matrix_fill_normal(Matrix *m, Rng *rng, double std_dev);
+
+Matrix *matrix_transpose(Matrix *dest, Matrix *src);
+
+Matrix *matrix_add_transposed(Matrix *dest, Matrix *src);
 
 #endif
\ No newline at end of file
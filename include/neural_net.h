@@ -4,23 +4,91 @@
 #include <matrix.h>
 #include <vector.h>
 #include <image.h>
+#include <stream.h>
+#include <profile.h>
+#include <optimizer.h>
+#include <stddef.h>
+
+typedef enum
+{
+    OUTPUT_SIGMOID,
+    OUTPUT_SOFTMAX
+} Output_Type;
 
 typedef struct
 {
     int layers;
     int total_values;
+    Output_Type output;
+    real *values;
     Matrix *weights;
     Vector *biases;
+    void *map;
+    size_t map_size;
 } Neural_Net;
 
+typedef struct
+{
+    int iterations;
+    int num_groups;
+    double step_size;
+    int batched;
+    int threads;
+    int prefetch;
+    int deterministic;
+    int verbose;
+    Profile *profile;
+    Optimizer_Type optimizer;
+    double momentum;
+    uint64_t seed;
+} Train_Options;
+
+typedef struct
+{
+    int count;
+    int correct_guesses;
+    double cost;
+    double inputs;
+} Train_Stats;
+
+typedef struct Optimize_Pool Optimize_Pool;
+
 Neural_Net network_malloc(int layers, int *neurons_per_layer);
 
 void network_free(Neural_Net n);
 
 void network_free_p(Neural_Net *n);
 
-void network_initialize(Neural_Net *Neural_Net, double std_dev);
+int network_save(Neural_Net *network, const char *file);
+
+Neural_Net *network_load(const char *file);
+
+Vector network_view_values(Neural_Net *network);
+
+int network_parse_output(const char *name, Output_Type *output);
+
+const char *network_output_name(Output_Type output);
+
+void network_initialize(Neural_Net *Neural_Net, Rng *rng, double std_dev);
+
+Train_Options train_options_default();
+
+Optimize_Pool *optimize_pool_start(Neural_Net *network, Train_Options *options);
+
+void optimize_pool_stop(Optimize_Pool *pool);
+
+Train_Stats network_optimize(Optimize_Pool *pool, Neural_Net *network, Dataset *dataset, Matrix *inputs,
+                             Train_Options *options, Optimizer *optimizer, double step_size);
+
+Train_Stats network_train_iteration(Optimize_Pool *pool, Neural_Net *network, Dataset *dataset, int *order, Rng *rng,
+                                    Train_Options *options, Optimizer *optimizer, double step_size);
+
+Train_Stats network_train_stream_iteration(Optimize_Pool *pool, Neural_Net *network, Image_Stream *stream,
+                                           Dataset *segment, Rng *rng, Train_Options *options, Optimizer *optimizer,
+                                           double step_size);
+
+int network_train(Neural_Net *Neural_Net, Dataset *dataset, Train_Options *options);
 
-void network_train(Neural_Net *Neural_Net, Dataset *dataset, int iterations, int num_groups, double step_size);
+int network_train_stream(Neural_Net *network, Image_Stream *stream, Train_Options *options);
 
 #endif
\ No newline at end of file
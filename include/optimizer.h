@@ -0,0 +1,35 @@
+#ifndef OPTIMIZER_INCLUDE
+#define OPTIMIZER_INCLUDE
+
+#include <vector.h>
+
+typedef enum
+{
+    OPTIMIZER_SGD,
+    OPTIMIZER_MOMENTUM,
+    OPTIMIZER_NESTEROV,
+    OPTIMIZER_ADAM
+} Optimizer_Type;
+
+typedef struct
+{
+    Optimizer_Type type;
+    double momentum;
+    double beta2;
+    double epsilon;
+    long steps;
+    Vector velocity;
+    Vector second_moment;
+} Optimizer;
+
+Optimizer optimizer_malloc(Optimizer_Type type, double momentum, int size);
+
+void optimizer_free(Optimizer o);
+
+int optimizer_parse_type(const char *name, Optimizer_Type *type);
+
+const char *optimizer_type_name(Optimizer_Type type);
+
+void optimizer_step(Optimizer *o, Vector *values, Vector *gradient, double gradient_scale, double step_size);
+
+#endif
\ No newline at end of file
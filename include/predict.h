@@ -0,0 +1,26 @@
+#ifndef PREDICT_INCLUDE
+#define PREDICT_INCLUDE
+
+#include <neural_net.h>
+#include <matrix.h>
+#include <vector.h>
+#include <topology.h>
+
+typedef struct
+{
+    Neural_Net *network;
+    int batch_size;
+    Matrix buffers[2];
+    const Topology *topology;
+    real *packed;
+} Predictor;
+
+Predictor predictor_malloc(Neural_Net *network, int batch_size);
+
+void predictor_free(Predictor p);
+
+int network_predict(Predictor *predictor, Vector *input, Vector *scores);
+
+Matrix *network_predict_batch(Predictor *predictor, Matrix *input, int *labels);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef PREFETCH_INCLUDE
+#define PREFETCH_INCLUDE
+
+#include <matrix.h>
+#include <image.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define PREFETCH_SLOTS 2
+
+typedef struct
+{
+    int offset;
+    int count;
+    Matrix inputs;
+} Prefetch_Batch;
+
+typedef struct
+{
+    Dataset *dataset;
+    int batch_size;
+    int batches;
+    Prefetch_Batch slots[PREFETCH_SLOTS];
+    atomic_int produced;
+    atomic_int consumed;
+    atomic_int stopping;
+    pthread_t thread;
+} Prefetcher;
+
+Prefetcher *prefetch_start(Dataset *dataset, int batch_size, int batches);
+
+Prefetch_Batch *prefetch_next(Prefetcher *p);
+
+void prefetch_release(Prefetcher *p);
+
+void prefetch_stop(Prefetcher *p);
+
+#endif
\ No newline at end of file
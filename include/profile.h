@@ -0,0 +1,37 @@
+#ifndef PROFILE_INCLUDE
+#define PROFILE_INCLUDE
+
+#include <stdint.h>
+
+typedef enum
+{
+    PROFILE_LOAD,
+    PROFILE_SHUFFLE,
+    PROFILE_GATHER,
+    PROFILE_FORWARD,
+    PROFILE_BACKWARD,
+    PROFILE_WAIT,
+    PROFILE_REDUCE,
+    PROFILE_ADJUST,
+    PROFILE_PHASES
+} Profile_Phase;
+
+typedef struct
+{
+    uint64_t ns[PROFILE_PHASES];
+    uint32_t recorded;
+} Profile;
+
+uint64_t profile_now();
+
+void profile_reset(Profile *p);
+
+uint64_t profile_start(Profile *p);
+
+void profile_stop(Profile *p, Profile_Phase phase, uint64_t start);
+
+void profile_add(Profile *dest, Profile *src);
+
+void profile_print_json(Profile *p);
+
+#endif
\ No newline at end of file
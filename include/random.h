@@ -1,8 +1,26 @@
 #ifndef RANDOM_INCLUDE
 #define RANDOM_INCLUDE
 
-double rnd_double(void);
+#include <stdint.h>
+#include <real.h>
 
-double rnd_normal(double std_dev);
+typedef struct
+{
+    uint64_t s[4];
+} Rng;
+
+Rng rnd_create(uint64_t seed);
+
+Rng rnd_split(Rng *rng);
+
+uint64_t rnd_next(Rng *rng);
+
+double rnd_double(Rng *rng);
+
+uint32_t rnd_below(Rng *rng, uint32_t n);
+
+double rnd_normal(Rng *rng, double std_dev);
+
+void rnd_fill_normal(Rng *rng, real *dest, int n, double std_dev);
 
 #endif
\ No newline at end of file
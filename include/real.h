@@ -0,0 +1,13 @@
+#ifndef REAL_INCLUDE
+#define REAL_INCLUDE
+
+// Floating point type used for all network and dataset values. Define SINGLE_PRECISION when compiling to use float.
+#ifdef SINGLE_PRECISION
+typedef float real;
+#define REAL_EXP expf
+#else
+typedef double real;
+#define REAL_EXP exp
+#endif
+
+#endif
\ No newline at end of file
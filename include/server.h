@@ -0,0 +1,22 @@
+#ifndef SERVER_INCLUDE
+#define SERVER_INCLUDE
+
+#include <neural_net.h>
+#include <image.h>
+
+typedef struct
+{
+    int max_batch;
+    int max_wait_us;
+    int queue_size;
+} Server_Options;
+
+Server_Options server_options_default();
+
+int server_run_socket(Neural_Net *network, const char *path, Server_Options *options);
+
+int server_run_stream(Neural_Net *network, int in_fd, int out_fd, Server_Options *options);
+
+int client_run(const char *path, Dataset *dataset);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,43 @@
+#ifndef STREAM_INCLUDE
+#define STREAM_INCLUDE
+
+#include <image.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct
+{
+    int fd;
+    size_t header_size;
+    uint8_t *buffer;
+    size_t position;
+    size_t end;
+} Stream_Reader;
+
+typedef struct
+{
+    Stream_Reader images;
+    Stream_Reader labels;
+    int count;
+    int size;
+    int read;
+    int sparse;
+    int classes;
+    Rng rng;
+    int buffer_capacity;
+    int buffer_count;
+    uint8_t *buffer_pixels;
+    uint8_t *buffer_labels;
+} Image_Stream;
+
+Image_Stream *stream_open(const char *image_file, const char *label_file, int buffer_capacity);
+
+void stream_close(Image_Stream *s);
+
+int stream_rewind(Image_Stream *s, Rng *rng);
+
+Dataset *stream_dataset_malloc(Image_Stream *s, int capacity);
+
+int stream_read(Image_Stream *s, Dataset *dest, int count);
+
+#endif
\ No newline at end of file
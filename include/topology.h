@@ -0,0 +1,21 @@
+#ifndef TOPOLOGY_INCLUDE
+#define TOPOLOGY_INCLUDE
+
+#include <neural_net.h>
+#include <real.h>
+
+typedef void (*Topology_Run)(real *dest, const real *packed, const real *input, int rows, int softmax);
+
+typedef struct
+{
+    const char *name;
+    int layers;
+    const int *sizes;
+    Topology_Run run;
+} Topology;
+
+const Topology *topology_find(Neural_Net *network);
+
+real *topology_pack(const Topology *topology, Neural_Net *network);
+
+#endif
\ No newline at end of file
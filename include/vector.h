@@ -2,13 +2,21 @@
 #define VECTOR_INCLUDE
 
 #include <matrix.h>
+#include <stdint.h>
 
 typedef struct
 {
     int size;
-    double *values;
+    real *values;
 } Vector;
 
+typedef struct
+{
+    int count;
+    const int32_t *indices;
+    real *values;
+} Sparse_Vector;
+
 Vector vector_malloc(int);
 
 Vector vector_calloc(int);
@@ -19,11 +27,11 @@ void vector_free_p(Vector *v);
 
 char *vector_to_string(const Vector v);
 
-void vector_fill(Vector *v, double *values);
+void vector_fill(Vector *v, real *values);
 
 void vector_fill_zero(Vector *v);
 
-void vector_fill_normal(Vector *v, double std_dev);
+void vector_fill_normal(Vector *v, Rng *rng, double std_dev);
 
 Vector *vector_copy(Vector *dest, Vector *src);
 
@@ -31,6 +39,8 @@ Vector *vector_ncopy(Vector *dest, Vector *src, int offset);
 
 Vector *vector_add(Vector *dest, Vector *v);
 
+Vector *vector_axpy(Vector *dest, real scale, Vector *v);
+
 double vector_magnitude(Vector *v);
 
 Vector *vector_sum_1(Vector *v);
@@ -43,4 +53,16 @@ Vector *vector_matrix_mult(Vector *dest, Vector *v, Matrix *m);
 
 Vector *vector_sigmoid(Vector *v);
 
+Vector vector_view_row(Matrix *m, int row);
+
+Vector vector_view_matrix(Matrix *m);
+
+Vector *vector_add_matrix_rows(Vector *dest, Matrix *m);
+
+Matrix *matrix_add_sparse_outer(Matrix *dest, Sparse_Vector *v, Vector *u);
+
+Vector *vector_softmax(Vector *v);
+
+double vector_softmax_cross_entropy(Vector *z, Vector *y);
+
 #endif
\ No newline at end of file
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
+#include <math_ext.h>
+#include <kernel.h>
 
 /*
 Notation used:
@@ -13,160 +15,402 @@ Notation used:
     b_i = bias index i
 */
 
+/**
+ * @brief Allocates a workspace for performing backpropagation on a network.
+ *
+ * @param network network the workspace will be used with.
+ * @param batch_size maximum number of inputs that will be backpropagated at once.
+ * @return a new workspace with memory allocated for the largest layer of the network.
+ */
+Backprop_Workspace backprop_workspace_malloc(Neural_Net *network, int batch_size)
+{
+    int widest = network->weights[0].width;
+    for (int i = 0; i < network->layers; i++)
+        widest = MAX(widest, network->weights[i].height);
+
+    Backprop_Workspace new;
+    new.dc_da = matrix_malloc(widest, batch_size);
+    new.dc_da_prev = matrix_malloc(widest, batch_size);
+    new.da_dz = matrix_malloc(widest, batch_size);
+
+    return new;
+}
+
+/**
+ * @brief Frees memory used by a backpropagation workspace.
+ *
+ * @param w workspace to free memory of.
+ */
+void backprop_workspace_free(Backprop_Workspace w)
+{
+    matrix_free(w.dc_da);
+    matrix_free(w.dc_da_prev);
+    matrix_free(w.da_dz);
+}
+
+/**
+ * @brief Create a matrix that refers to the start of some workspace memory.
+ *
+ * @param m workspace matrix to refer to.
+ * @param width width of the matrix.
+ * @param height height of the matrix.
+ * @return a matrix referring to the workspace memory.
+ */
+Matrix backprop_workspace_view(Matrix *m, int width, int height)
+{
+    Matrix view;
+    view.width = width;
+    view.height = height;
+    view.values = m->values;
+
+    return view;
+}
+
+/**
+ * @brief Create a matrix that refers to the part of a gradient for the weights of a layer.
+ *
+ * @param gradient gradient to refer to.
+ * @param network network the gradient is for.
+ * @param l layer of the weights.
+ * @return a matrix referring to the gradient memory.
+ */
+Matrix backprop_gradient_weights(Vector *gradient, Neural_Net *network, int l)
+{
+    Matrix view = network->weights[l];
+    view.values = gradient->values + (network->weights[l].values - network->values);
+
+    return view;
+}
+
+/**
+ * @brief Create a vector that refers to the part of a gradient for the biases of a layer.
+ *
+ * @param gradient gradient to refer to.
+ * @param network network the gradient is for.
+ * @param l layer of the biases.
+ * @return a vector referring to the gradient memory.
+ */
+Vector backprop_gradient_biases(Vector *gradient, Neural_Net *network, int l)
+{
+    Vector view = network->biases[l];
+    view.values = gradient->values + (network->biases[l].values - network->values);
+
+    return view;
+}
+
 /**
  * @brief Calculate derivative of cost with respect to the last node values.
  *
+ * With a sigmoid output the cost is the squared error, so the derivative is 2(a - y). With a softmax output the cost is
+ * the cross-entropy, and the derivative through the softmax to the raw node values simplifies to a - y. That is
+ * returned in place of dc_da, and the caller uses 1 for da_dz of the last layer.
+ *
  * @param dc_da vector to store results in.
  * @param a actual result.
  * @param y expected result.
+ * @param output kind of output layer.
  */
-void backprop_calc_init_dc_da(Vector *dc_da, Vector *a, Vector *y)
+void backprop_calc_init_dc_da(Vector *dc_da, Vector *a, Vector *y, Output_Type output)
 {
-    // Vector *normalized = malloc(sizeof(Vector));
-    // *normalized = vector_malloc(a->size);
-    // vector_copy(normalized, a);
-    // vector_sum_1(normalized);
-
+    const real scale = output == OUTPUT_SOFTMAX ? 1 : 2;
     for (int i = 0; i < dc_da->size; i++)
-    {
-        float temp = (a->values[i] - y->values[i]);
-        dc_da->values[i] = 2 * temp * temp;
-        // dc_da->values[i] = -y->values[i] / normalized->values[i];
-    }
-
-    // vector_free_p(normalized);
+        dc_da->values[i] = scale * (a->values[i] - y->values[i]);
 }
 
 /**
- * @brief Calculate derivative of the node values with respect to the raw node values.
+ * @brief Calculate the derivative of the cost with respect to the raw node values of a layer (delta = da_dz * dc_da).
+ * The derivative of the sigmoid function is a(1 - a), so it is found from the node values without calling exp again.
  *
- * @param da_dz vector to store result in.
- * @param z raw node value.
+ * @param delta vector to store the result in.
+ * @param a node values of the layer.
+ * @param dc_da derivative of the cost with respect to the node values of the layer.
+ * @param softmax whether the layer is a softmax output, in which case dc_da already holds the derivative with respect to
+ * the raw node values (see backprop_calc_init_dc_da).
  */
-void backprop_calc_da_dz(Vector *da_dz, Vector *z)
+void backprop_calc_delta(Vector *delta, Vector *a, Vector *dc_da, int softmax)
 {
-    for (int i = 0; i < da_dz->size; i++)
+    if (softmax)
     {
-        double temp = exp(-z->values[i]);
-        double temp2 = 1 + temp;
-        da_dz->values[i] = temp / (temp2 * temp2);
+        vector_copy(delta, dc_da);
+        return;
     }
+
+    for (int i = 0; i < delta->size; i++)
+        delta->values[i] = a->values[i] * (1 - a->values[i]) * dc_da->values[i];
 }
 
 /**
- * @brief Calculate derivative of the costs with respect to the biases.
+ * @brief Add the derivative of the costs with respect to the weights to a gradient.
  *
- * @param dc_db vector to store the results in.
+ * @param dc_dw matrix to add the results to.
+ * @param a node values the weights come from.
  * @param da_dz derivative of the node values with respect to the raw node values the weights go to,
  * @param dc_da derivative of cost with respect to the node values the weights go to.
  */
-void backprop_calc_dc_db(Vector *dc_db, Vector *da_dz, Vector *dc_da)
+void backprop_calc_dc_dw(Matrix *dc_dw, Vector *a, Vector *da_dz, Vector *dc_da)
 {
-    for (int i = 0; i < dc_db->size; i++)
-        dc_db->values[i] = da_dz->values[i] * dc_da->values[i];
+    for (int i = 0; i < dc_dw->height; i++)
+        kernel_axpy(dc_dw->values + i * dc_dw->width, da_dz->values[i] * dc_da->values[i], a->values, dc_dw->width);
 }
 
 /**
- * @brief Calculate derivative of the costs with respect to the weights.
+ * @brief Calculate derivative of the costs with respect to the previous node values.
  *
- * @param dc_dw vector to store the results in.
- * @param a node values the weights come from.
- * @param da_dz derivative of the node values with respect to the raw node values the weights go to,
- * @param dc_da derivative of cost with respect to the node values the weights go to.
+ * Rather than walking down each column of the weights, each row of the weights is scaled and added to the result, so
+ * the weights are read in the order they are stored.
+ *
+ * @param dc_da_prev vector to store the results in.
+ * @param w weights from previous node values to current node values.
+ * @param da_dz derivative of the current node values with respect to the current raw node values,
+ * @param dc_da derivative of cost with respect to the current node values.
  */
-void backprop_calc_dc_dw(Vector *dc_dw, Vector *a, Vector *da_dz, Vector *dc_da)
+void backprop_calc_dc_da(Vector *dc_da_prev, Matrix *w, Vector *da_dz, Vector *dc_da)
 {
-    for (int k = 0; k < dc_dw->size; k++)
+    vector_fill_zero(dc_da_prev);
+    for (int i = 0; i < dc_da->size; i++)
+        kernel_axpy(dc_da_prev->values, da_dz->values[i] * dc_da->values[i], w->values + i * w->width, w->width);
+}
+
+/**
+ * @brief Add the derivatives of the cost with respect to a layer's weights to a gradient and calculate the derivatives
+ * with respect to the previous node values for one input, in a single traversal of the weights.
+ *
+ * @param dc_dw matrix to add the derivatives of the weights to.
+ * @param prev_row place to store the derivatives of the previous node values, or 0 if they are not needed.
+ * @param w weights of the layer.
+ * @param a_row previous node values.
+ * @param delta_row derivative of the cost with respect to the raw node values of the layer.
+ */
+void backprop_calc_layer_row(Matrix *dc_dw, real *prev_row, Matrix *w, const real *a_row, const real *delta_row)
+{
+    const int BLOCK = 4;
+    const int width = w->width;
+
+    if (!prev_row)
     {
-        int i = k / a->size; // Index of node weight goes to
-        int j = k % a->size; // Index of node weight comes from
+        for (int i = 0; i < w->height; i++)
+            kernel_axpy(dc_dw->values + i * width, delta_row[i], a_row, width);
+        return;
+    }
+
+    for (int j = 0; j < width; j++)
+        prev_row[j] = 0;
 
-        dc_dw->values[k] = a->values[j] * da_dz->values[i] * dc_da->values[i];
+    // Take the nodes BLOCK at a time so the row of dc_da_prev is read and written once per block
+    int i = 0;
+    for (; i + BLOCK <= w->height; i += BLOCK)
+        kernel_outer_axpy4(dc_dw->values + i * width, prev_row, a_row, w->values + i * width, width, delta_row + i,
+                           width);
+    for (; i < w->height; i++)
+    {
+        kernel_axpy(dc_dw->values + i * width, delta_row[i], a_row, width);
+        kernel_axpy(prev_row, delta_row[i], w->values + i * width, width);
     }
 }
 
 /**
- * @brief Calculate derivative of the costs with respect to the previous node values.
+ * @brief Add the derivatives of the cost with respect to a layer's weights to a gradient and calculate the derivatives
+ * with respect to the previous node values, for a batch of inputs.
  *
- * @param dc_da_prev vector to store the results in.
- * @param w weights from previous node values to current node values.
- * @param da_dz derivative of the current node values with respect to the current raw node values,
- * @param dc_da derivative of cost with respect to the current node values.
+ * A single input is done in one traversal of the weights by backprop_calc_layer_row. A batch is done as the two matrix
+ * products dc_dw += delta^T a_prev and dc_da_prev = delta w, in blocks of BLOCK rows of the result whose sums are kept
+ * in registers over the whole batch for dc_dw and over all the nodes for dc_da_prev. The columns are taken COLUMNS at a
+ * time, so the part of a_prev or w that each block reads stays in cache for the next block. Every value is still
+ * summed in order of input and of node, so the result does not depend on the size of the batch.
+ *
+ * @param dc_dw matrix to add the derivatives of the weights to.
+ * @param dc_da_prev matrix to store the derivatives of the previous node values in, one row per input, or 0 if they are
+ * not needed.
+ * @param w weights of the layer.
+ * @param a_prev previous node values, one row per input.
+ * @param delta derivative of the cost with respect to the raw node values of the layer, one row per input.
  */
-void backprop_calc_dc_da(Vector *dc_da_prev, Matrix *w, Vector *da_dz, Vector *dc_da)
+void backprop_calc_layer(Matrix *dc_dw, Matrix *dc_da_prev, Matrix *w, Matrix *a_prev, Matrix *delta)
 {
-    for (int j = 0; j < dc_da_prev->size; j++)
+    const int BLOCK = 4;
+    const int COLUMNS = 64;
+    const int width = w->width;
+    const int nodes = w->height;
+    const int batch_size = delta->height;
+
+    if (batch_size == 1)
+    {
+        backprop_calc_layer_row(dc_dw, dc_da_prev ? dc_da_prev->values : 0, w, a_prev->values, delta->values);
+        return;
+    }
+
+    for (int c = 0; c < width; c += COLUMNS)
     {
-        dc_da_prev->values[j] = 0;
-        for (int i = 0; i < dc_da->size; i++)
-            dc_da_prev->values[j] += w->values[i * w->width + j] * da_dz->values[i] * dc_da->values[i];
+        const int columns = MIN(COLUMNS, width - c);
+
+        // dc_dw += delta^T a_prev, BLOCK nodes at a time
+        int i = 0;
+        for (; i + BLOCK <= nodes; i += BLOCK)
+            kernel_matrix_axpy4(dc_dw->values + i * width + c, a_prev->values + c, width, batch_size,
+                                delta->values + i, delta->width, 1, columns);
+        for (; i < nodes; i++)
+            for (int n = 0; n < batch_size; n++)
+                kernel_axpy(dc_dw->values + i * width + c, delta->values[n * delta->width + i],
+                            a_prev->values + n * width + c, columns);
+
+        if (!dc_da_prev)
+            continue;
+
+        // dc_da_prev = delta w, BLOCK inputs at a time
+        for (int n = 0; n < batch_size; n++)
+            for (int j = 0; j < columns; j++)
+                dc_da_prev->values[n * width + c + j] = 0;
+
+        int n = 0;
+        for (; n + BLOCK <= batch_size; n += BLOCK)
+            kernel_matrix_axpy4(dc_da_prev->values + n * width + c, w->values + c, width, nodes,
+                                delta->values + n * delta->width, 1, delta->width, columns);
+        for (; n < batch_size; n++)
+            for (int k = 0; k < nodes; k++)
+                kernel_axpy(dc_da_prev->values + n * width + c, delta->values[n * delta->width + k],
+                            w->values + k * width + c, columns);
     }
 }
 
 /**
- * @brief Perform backpropagation to calculate the gradient of the network for an input.
+ * @brief Perform backpropagation to calculate the gradient of the network for an input and add it to a gradient.
  *
- * @param gradient vector to store the result in.
+ * @param gradient vector to add the result to.
+ * @param workspace workspace to store intermediate values in, with room for at least one input.
  * @param network network that backpropagation is being performed on.
- * @param raw_node_values raw node values for an input.
  * @param node_values node values for an input.
- * @return vector result. The vector starts with the gradient for the final set of weights, then the final set of biases
- * and continues alternating weight and biases from the end of the network to the start.
+ * @param expected_result expected result for the input.
+ * @param sparse sparse input used in place of node_values[-1], or 0 to use node_values[-1].
+ * @param sparse_dc_dw matrix to add the derivatives of the first layer's weights to, transposed, when the input is
+ * sparse. Only the rows for nonzero inputs are touched.
+ * @return vector result. The vector is laid out the same as the values of the network (see network_view_values).
  */
-Vector *backprop_calc_grad(Vector *gradient, Neural_Net *network, Vector *raw_node_values, Vector *node_values, Vector *expected_result)
+Vector *backprop_calc_grad(Vector *gradient, Backprop_Workspace *workspace, Neural_Net *network, Vector *node_values, Vector *expected_result, Sparse_Vector *sparse, Matrix *sparse_dc_dw)
 {
-    // Create all needed vectors
-    Vector *dc_da = malloc(sizeof(Vector));
-    *dc_da = vector_malloc(expected_result->size);
-    Vector *da_dz = malloc(sizeof(Vector));
-    Vector *dc_dw = malloc(sizeof(Vector));
-    Vector *dc_db = malloc(sizeof(Vector));
-    Vector *dc_da_prev = malloc(sizeof(Vector));
+    Matrix dc_da_m = workspace->dc_da;
+    Matrix dc_da_prev_m = workspace->dc_da_prev;
+
+    Vector dc_da = vector_view_row(&dc_da_m, 0);
+    dc_da.size = expected_result->size;
+    Vector delta = vector_view_row(&workspace->da_dz, 0);
 
     int l = network->layers - 1;
-    backprop_calc_init_dc_da(dc_da, node_values + l, expected_result);
+    backprop_calc_init_dc_da(&dc_da, node_values + l, expected_result, network->output);
 
-    int index = 0;
     for (; l >= 0; l--)
     {
-        *da_dz = vector_malloc(raw_node_values[l].size);
-        backprop_calc_da_dz(da_dz, raw_node_values + l);
+        // Refer to this layer's part of the gradient
+        Matrix dc_dw = backprop_gradient_weights(gradient, network, l);
+        Vector dc_db = backprop_gradient_biases(gradient, network, l);
 
-        *dc_db = vector_malloc(network->biases[l].size);
-        backprop_calc_dc_db(dc_db, da_dz, dc_da);
+        delta.size = node_values[l].size;
+        backprop_calc_delta(&delta, node_values + l, &dc_da,
+                            l == network->layers - 1 && network->output == OUTPUT_SOFTMAX);
+        vector_add(&dc_db, &delta);
 
-        // TODO: optimize to use bias derivatives
-        *dc_dw = vector_malloc(network->weights[l].width * network->weights[l].height);
-        backprop_calc_dc_dw(dc_dw, node_values + (l - 1), da_dz, dc_da);
+        if (l == 0 && sparse)
+        {
+            matrix_add_sparse_outer(sparse_dc_dw, sparse, &delta);
+            break;
+        }
+
+        // The input is run as a batch of one row
+        Matrix a_prev = {node_values[l - 1].size, 1, node_values[l - 1].values};
+        Matrix delta_m = {delta.size, 1, delta.values};
 
         // Do not calculate the next dc_da if on the first layer
-        if (l != 0)
+        if (l == 0)
         {
-            *dc_da_prev = vector_malloc(node_values[l - 1].size);
-            backprop_calc_dc_da(dc_da_prev, network->weights + l, da_dz, dc_da);
-            // Update dc_da
-            vector_free(*dc_da);
-            *dc_da = *dc_da_prev;
+            backprop_calc_layer(&dc_dw, 0, network->weights + l, &a_prev, &delta_m);
+            break;
         }
 
-        // Copy values to gradient
-        vector_ncopy(gradient, dc_dw, index);
-        index += dc_dw->size;
-        vector_ncopy(gradient, dc_db, index);
-        index += dc_db->size;
+        Matrix dc_da_prev = backprop_workspace_view(&dc_da_prev_m, node_values[l - 1].size, 1);
+        backprop_calc_layer(&dc_dw, &dc_da_prev, network->weights + l, &a_prev, &delta_m);
 
-        // Free values
-        vector_free(*da_dz);
-        vector_free(*dc_db);
-        vector_free(*dc_dw);
+        // Swap buffers so dc_da_prev becomes dc_da
+        Matrix temp = dc_da_m;
+        dc_da_m = dc_da_prev_m;
+        dc_da_prev_m = temp;
+        dc_da = vector_view_row(&dc_da_prev, 0);
     }
 
-    // Free values
-    vector_free_p(dc_da);
-    free(da_dz);
-    free(dc_dw);
-    free(dc_db);
-    free(dc_da_prev);
+    return gradient;
+}
+
+/**
+ * @brief Perform backpropagation to calculate the gradient of the network summed over a batch of inputs and add it to
+ * a gradient.
+ *
+ * Each matrix holds one input per row, so the weight updates become matrix-matrix products that reuse the weights
+ * across the whole batch rather than one matrix-vector product per input.
+ *
+ * @param gradient vector to add the result to.
+ * @param workspace workspace to store intermediate values in, with room for at least the whole batch.
+ * @param network network that backpropagation is being performed on.
+ * @param node_values node values for each layer, one row per input. node_values[-1] must hold the inputs.
+ * @param expected_results expected results, one row per input.
+ * @param sparse sparse input for each row used in place of node_values[-1], or 0 to use node_values[-1].
+ * @param sparse_dc_dw matrix to add the derivatives of the first layer's weights to, transposed, when the inputs are
+ * sparse.
+ * @return vector result, laid out the same as backprop_calc_grad.
+ */
+Vector *backprop_calc_grad_batch(Vector *gradient, Backprop_Workspace *workspace, Neural_Net *network, Matrix *node_values, Matrix *expected_results, Sparse_Vector *sparse, Matrix *sparse_dc_dw)
+{
+    const int batch_size = expected_results->height;
+
+    Matrix dc_da_m = workspace->dc_da;
+    Matrix dc_da_prev_m = workspace->dc_da_prev;
+
+    Matrix dc_da = backprop_workspace_view(&dc_da_m, expected_results->width, batch_size);
+
+    int l = network->layers - 1;
+    Vector dc_da_view = vector_view_matrix(&dc_da);
+    Vector a_view = vector_view_matrix(node_values + l);
+    Vector y_view = vector_view_matrix(expected_results);
+    backprop_calc_init_dc_da(&dc_da_view, &a_view, &y_view, network->output);
+
+    for (; l >= 0; l--)
+    {
+        // Refer to this layer's part of the gradient
+        Matrix dc_dw = backprop_gradient_weights(gradient, network, l);
+        Vector dc_db = backprop_gradient_biases(gradient, network, l);
+
+        Matrix delta = backprop_workspace_view(&workspace->da_dz, node_values[l].width, batch_size);
+        Vector delta_view = vector_view_matrix(&delta);
+        a_view = vector_view_matrix(node_values + l);
+        dc_da_view = vector_view_matrix(&dc_da);
+        backprop_calc_delta(&delta_view, &a_view, &dc_da_view,
+                            l == network->layers - 1 && network->output == OUTPUT_SOFTMAX);
+
+        vector_add_matrix_rows(&dc_db, &delta);
+
+        if (l == 0 && sparse)
+        {
+            for (int n = 0; n < batch_size; n++)
+            {
+                Vector delta_row = vector_view_row(&delta, n);
+                matrix_add_sparse_outer(sparse_dc_dw, sparse + n, &delta_row);
+            }
+            break;
+        }
+
+        // Do not calculate the next dc_da if on the first layer
+        if (l == 0)
+        {
+            backprop_calc_layer(&dc_dw, 0, network->weights + l, node_values + (l - 1), &delta);
+            break;
+        }
+
+        Matrix dc_da_prev = backprop_workspace_view(&dc_da_prev_m, node_values[l - 1].width, batch_size);
+        backprop_calc_layer(&dc_dw, &dc_da_prev, network->weights + l, node_values + (l - 1), &delta);
+
+        // Swap buffers so dc_da_prev becomes dc_da
+        Matrix temp = dc_da_m;
+        dc_da_m = dc_da_prev_m;
+        dc_da_prev_m = temp;
+        dc_da = dc_da_prev;
+    }
 
     return gradient;
-}
\ No newline at end of file
+}
@@ -0,0 +1,501 @@
+#include <bench.h>
+#include <neural_net.h>
+#include <backpropagation.h>
+#include <predict.h>
+#include <kernel.h>
+#include <math_ext.h>
+#include <random.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/*
+Every result is printed as a single line JSON object so the output can be collected and compared across commits. All
+results include the precision and kernel versions in use, as those change the numbers more than anything else.
+*/
+
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_SYNTHETIC_COUNT 60000
+#define BENCH_SEED 1
+#define BENCH_CLASSES 10
+#define BENCH_BATCH 64
+
+/**
+ * @brief Get the current time.
+ *
+ * @return seconds since an arbitrary point.
+ */
+double bench_now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Print the start of a result line with the fields shared by all results.
+ *
+ * @param name name of the benchmark.
+ * @param shape description of the sizes used.
+ */
+void bench_print_start(const char *name, const char *shape)
+{
+    printf("{\"bench\":\"%s\",\"shape\":\"%s\",\"precision\":\"%s\",\"kernel\":\"%s\"", name, shape,
+           sizeof(real) == sizeof(float) ? "float" : "double", kernel_name());
+}
+
+/**
+ * @brief Print a result for a benchmark timed over a number of repetitions.
+ *
+ * @param name name of the benchmark.
+ * @param shape description of the sizes used.
+ * @param reps number of repetitions.
+ * @param seconds total time of all the repetitions.
+ * @param flops floating point operations in each repetition, or 0 if not meaningful.
+ */
+void bench_print(const char *name, const char *shape, long reps, double seconds, double flops)
+{
+    bench_print_start(name, shape);
+    printf(",\"reps\":%li,\"ns_per_op\":%.1f", reps, seconds * 1e9 / reps);
+    if (flops > 0)
+        printf(",\"gflops\":%.3f", flops * reps / seconds * 1e-9);
+    printf("}\n");
+    fflush(stdout);
+}
+
+/**
+ * @brief Fill memory with random values between -1 and 1.
+ *
+ * @param values memory to fill.
+ * @param count number of values.
+ * @param rng random number generator to use.
+ */
+void bench_fill_random(real *values, int count, Rng *rng)
+{
+    for (int i = 0; i < count; i++)
+        values[i] = 2 * rnd_double(rng) - 1;
+}
+
+/**
+ * @brief Time the individual kernels of training and inference for one layer shape.
+ *
+ * @param inputs number of inputs to the layer.
+ * @param outputs number of outputs of the layer.
+ */
+void bench_kernels(int inputs, int outputs)
+{
+    char shape[32];
+    snprintf(shape, sizeof(shape), "%ix%i", inputs, outputs);
+    Rng rng = rnd_create(BENCH_SEED);
+
+    Matrix w = matrix_malloc(inputs, outputs);
+    Matrix dc_dw = matrix_malloc(inputs, outputs);
+    Vector a = vector_malloc(inputs);
+    Vector dc_da_prev = vector_malloc(inputs);
+    Vector z = vector_malloc(outputs);
+    Vector da_dz = vector_malloc(outputs);
+    Vector dc_da = vector_malloc(outputs);
+    bench_fill_random(w.values, inputs * outputs, &rng);
+    bench_fill_random(dc_dw.values, inputs * outputs, &rng);
+    bench_fill_random(a.values, inputs, &rng);
+    bench_fill_random(da_dz.values, outputs, &rng);
+    bench_fill_random(dc_da.values, outputs, &rng);
+
+    const double flops = 2.0 * inputs * outputs;
+    long reps;
+    double start, seconds;
+
+    reps = 0;
+    start = bench_now();
+    do
+    {
+        for (int i = 0; i < 100; i++)
+            vector_matrix_mult(&z, &a, &w);
+        reps += 100;
+    } while ((seconds = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_print("kernel.vector_matrix_mult", shape, reps, seconds, flops);
+
+    reps = 0;
+    start = bench_now();
+    do
+    {
+        for (int i = 0; i < 100; i++)
+            backprop_calc_dc_dw(&dc_dw, &a, &da_dz, &dc_da);
+        reps += 100;
+    } while ((seconds = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_print("kernel.backprop_calc_dc_dw", shape, reps, seconds, flops);
+
+    reps = 0;
+    start = bench_now();
+    do
+    {
+        for (int i = 0; i < 100; i++)
+            backprop_calc_dc_da(&dc_da_prev, &w, &da_dz, &dc_da);
+        reps += 100;
+    } while ((seconds = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_print("kernel.backprop_calc_dc_da", shape, reps, seconds, flops);
+
+    // Timed apart, each of the above can keep its matrix in cache, so they are also timed together as in training
+    reps = 0;
+    start = bench_now();
+    do
+    {
+        for (int i = 0; i < 100; i++)
+        {
+            backprop_calc_dc_dw(&dc_dw, &a, &da_dz, &dc_da);
+            backprop_calc_dc_da(&dc_da_prev, &w, &da_dz, &dc_da);
+        }
+        reps += 100;
+    } while ((seconds = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_print("kernel.backprop_calc_dc_dw+dc_da", shape, reps, seconds, 2 * flops);
+
+    // The fused layer does the work of both of the above in one traversal of the weights
+    Matrix a_m = {inputs, 1, a.values};
+    Matrix delta_m = {outputs, 1, da_dz.values};
+    Matrix dc_da_prev_m = {inputs, 1, dc_da_prev.values};
+    reps = 0;
+    start = bench_now();
+    do
+    {
+        for (int i = 0; i < 100; i++)
+            backprop_calc_layer(&dc_dw, &dc_da_prev_m, &w, &a_m, &delta_m);
+        reps += 100;
+    } while ((seconds = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_print("kernel.backprop_calc_layer", shape, reps, seconds, 2 * flops);
+
+    // A batch of inputs, first one input at a time with the separate kernels and then as matrix products by the layer
+    Matrix a_batch = matrix_malloc(inputs, BENCH_BATCH);
+    Matrix delta_batch = matrix_malloc(outputs, BENCH_BATCH);
+    Matrix dc_da_prev_batch = matrix_malloc(inputs, BENCH_BATCH);
+    Vector ones = vector_malloc(outputs);
+    bench_fill_random(a_batch.values, inputs * BENCH_BATCH, &rng);
+    bench_fill_random(delta_batch.values, outputs * BENCH_BATCH, &rng);
+    for (int i = 0; i < outputs; i++)
+        ones.values[i] = 1;
+    snprintf(shape, sizeof(shape), "%ix%i,batch=%i", inputs, outputs, BENCH_BATCH);
+
+    reps = 0;
+    start = bench_now();
+    do
+    {
+        for (int n = 0; n < BENCH_BATCH; n++)
+        {
+            Vector a_row = vector_view_row(&a_batch, n);
+            Vector delta_row = vector_view_row(&delta_batch, n);
+            Vector dc_da_prev_row = vector_view_row(&dc_da_prev_batch, n);
+            backprop_calc_dc_dw(&dc_dw, &a_row, &delta_row, &ones);
+            backprop_calc_dc_da(&dc_da_prev_row, &w, &delta_row, &ones);
+        }
+        reps++;
+    } while ((seconds = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_print("kernel.backprop_calc_dc_dw+dc_da", shape, reps, seconds, 2 * flops * BENCH_BATCH);
+
+    reps = 0;
+    start = bench_now();
+    do
+    {
+        backprop_calc_layer(&dc_dw, &dc_da_prev_batch, &w, &a_batch, &delta_batch);
+        reps++;
+    } while ((seconds = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_print("kernel.backprop_calc_layer", shape, reps, seconds, 2 * flops * BENCH_BATCH);
+
+    // Sigmoid is timed over the whole layer's weights so there is enough work to measure
+    Vector sigmoid_values = vector_view_matrix(&dc_dw);
+    reps = 0;
+    start = bench_now();
+    do
+    {
+        for (int i = 0; i < 10; i++)
+            vector_sigmoid(&sigmoid_values);
+        reps += 10;
+    } while ((seconds = bench_now() - start) < BENCH_MIN_SECONDS);
+    snprintf(shape, sizeof(shape), "%i", sigmoid_values.size);
+    bench_print("kernel.vector_sigmoid", shape, reps, seconds, 0);
+
+    matrix_free(w);
+    matrix_free(dc_dw);
+    matrix_free(a_batch);
+    matrix_free(delta_batch);
+    matrix_free(dc_da_prev_batch);
+    vector_free(ones);
+    vector_free(a);
+    vector_free(dc_da_prev);
+    vector_free(z);
+    vector_free(da_dz);
+    vector_free(dc_da);
+}
+
+/**
+ * @brief Write a synthetic dataset of random images in IDX format.
+ *
+ * @param image_file file to write the images to.
+ * @param label_file file to write the labels to.
+ * @param count number of images.
+ * @return 0 on success, otherwise -1.
+ */
+int bench_write_synthetic(const char *image_file, const char *label_file, int count)
+{
+    const int ROWS = 28, COLS = 28;
+
+    FILE *img_f = fopen(image_file, "wb");
+    FILE *lbl_f = fopen(label_file, "wb");
+    if (!img_f || !lbl_f)
+    {
+        if (img_f)
+            fclose(img_f);
+        if (lbl_f)
+            fclose(lbl_f);
+        return -1;
+    }
+
+    int32_t img_header[4] = {htonl(2051), htonl(count), htonl(ROWS), htonl(COLS)};
+    int32_t lbl_header[2] = {htonl(2049), htonl(count)};
+    fwrite(img_header, sizeof(int32_t), 4, img_f);
+    fwrite(lbl_header, sizeof(int32_t), 2, lbl_f);
+
+    // Roughly match MNIST, where most pixels are 0
+    Rng rng = rnd_create(BENCH_SEED);
+    uint8_t *pixels = malloc(ROWS * COLS);
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < ROWS * COLS; j++)
+            pixels[j] = rnd_double(&rng) < 0.2 ? rnd_below(&rng, 256) : 0;
+        uint8_t label = rnd_below(&rng, BENCH_CLASSES);
+        fwrite(pixels, 1, ROWS * COLS, img_f);
+        fwrite(&label, 1, 1, lbl_f);
+    }
+    free(pixels);
+
+    int ok = fclose(img_f) == 0;
+    ok = fclose(lbl_f) == 0 && ok;
+
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Time loading a dataset.
+ *
+ * @param image_file file that the image data is stored in.
+ * @param label_file file that the label data is stored in.
+ * @param source description of where the dataset came from.
+ */
+void bench_image_load(const char *image_file, const char *label_file, const char *source)
+{
+    long reps = 0;
+    double start = bench_now(), seconds;
+    do
+    {
+        Dataset *dataset = image_load(image_file, label_file);
+        if (!dataset)
+            return;
+        dataset_free_p(dataset);
+        reps++;
+    } while ((seconds = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_print("image_load", source, reps, seconds, 0);
+}
+
+/**
+ * @brief Time training steps and epochs on a dataset, first with dense inputs and then with the dataset sparsified.
+ *
+ * @param dataset dataset to train on, which is sparsified part way through.
+ * @param source description of where the dataset came from.
+ * @param threads number of threads to train with.
+ */
+void bench_training(Dataset *dataset, const char *source, int threads)
+{
+    int topology[4] = {dataset->images[0].size, 16, 16, BENCH_CLASSES};
+    Neural_Net network = network_malloc(4, topology);
+    Rng rng = rnd_create(BENCH_SEED);
+    network_initialize(&network, &rng, 1);
+
+    Train_Options options = train_options_default();
+    options.threads = threads;
+    options.verbose = 0;
+
+    // Steps reuse the same threads, as they do in training
+    Optimize_Pool *pool = optimize_pool_start(&network, &options);
+    if (!pool)
+    {
+        printf("failed to start %i training threads\n", threads);
+        network_free(network);
+        return;
+    }
+
+    const char *MODES[] = {"per_image", "batched", "sparse_per_image", "sparse_batched"};
+
+    char shape[64];
+    for (int m = 0; m < 4; m++)
+    {
+        options.batched = m % 2;
+        const char *mode = MODES[m];
+        if (m == 2 && dataset_sparsify(dataset) != 0)
+            break;
+
+        // One optimization step on a segment the size used by default training, which is never empty
+        Dataset *segment = dataset_subset(dataset, 0, MAX(1, dataset->count / options.num_groups));
+        long reps = 0;
+        double start = bench_now(), seconds;
+        do
+        {
+            network_optimize(pool, &network, segment, 0, &options, 0, options.step_size);
+            reps++;
+        } while ((seconds = bench_now() - start) < BENCH_MIN_SECONDS);
+        snprintf(shape, sizeof(shape), "%s,%s,%i,threads=%i", source, mode, segment->count, threads);
+        bench_print("network_optimize", shape, reps, seconds, 0);
+        free(segment);
+
+        // One full epoch
+        int *order = dataset_order_malloc(dataset);
+        start = bench_now();
+        network_train_iteration(pool, &network, dataset, order, &rng, &options, 0, options.step_size);
+        seconds = bench_now() - start;
+        free(order);
+
+        snprintf(shape, sizeof(shape), "%s,%s,%i,threads=%i", source, mode, dataset->count, threads);
+        bench_print_start("network_train_iteration", shape);
+        printf(",\"seconds\":%.4f,\"images_per_sec\":%.0f}\n", seconds, dataset->count / seconds);
+        fflush(stdout);
+    }
+
+    optimize_pool_stop(pool);
+    network_free(network);
+}
+
+/**
+ * @brief Time batch inference on a dataset, reporting throughput and latency percentiles of each batch.
+ *
+ * @param dataset dataset to run inference on.
+ * @param source description of where the dataset came from.
+ * @param batch_size number of images in each batch. It is limited to the number of images in the dataset.
+ * @param generic whether to use the generic forward pass even if the topology has a specialised one.
+ */
+void bench_inference(Dataset *dataset, const char *source, int batch_size, int generic)
+{
+    batch_size = MIN(batch_size, dataset->count);
+
+    int topology[4] = {dataset->images[0].size, 16, 16, BENCH_CLASSES};
+    Neural_Net network = network_malloc(4, topology);
+    Rng rng = rnd_create(BENCH_SEED);
+    network_initialize(&network, &rng, 1);
+
+    Predictor predictor = predictor_malloc(&network, batch_size);
+    if (generic)
+        predictor.topology = 0;
+    Matrix input = matrix_malloc(dataset->images[0].size, batch_size);
+    int *labels = malloc(sizeof(int) * batch_size);
+
+    const int batches = dataset->count / batch_size;
+    double *latencies = malloc(sizeof(double) * batches);
+
+    double start = bench_now();
+    for (int b = 0; b < batches; b++)
+    {
+        double batch_start = bench_now();
+        for (int n = 0; n < batch_size; n++)
+            image_convert(input.values + n * input.width, dataset_image(dataset, b * batch_size + n));
+        network_predict_batch(&predictor, &input, labels);
+        latencies[b] = bench_now() - batch_start;
+    }
+    double seconds = bench_now() - start;
+
+    qsort(latencies, batches, sizeof(double), compare_doubles);
+
+    char shape[64];
+    snprintf(shape, sizeof(shape), "%s,batch=%i,%s", source, batch_size,
+             predictor.topology ? predictor.topology->name : "generic");
+    bench_print_start("inference", shape);
+    printf(",\"images_per_sec\":%.0f,\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+           batches * batch_size / seconds, latencies[batches / 2] * 1e6, latencies[batches * 9 / 10] * 1e6,
+           latencies[batches * 99 / 100] * 1e6, latencies[batches - 1] * 1e6);
+    fflush(stdout);
+
+    free(latencies);
+    free(labels);
+    matrix_free(input);
+    predictor_free(predictor);
+    network_free(network);
+}
+
+/**
+ * @brief Run benchmarks on a dataset.
+ *
+ * @param image_file file that the image data is stored in.
+ * @param label_file file that the label data is stored in.
+ * @param source description of where the dataset came from.
+ * @param threads number of threads to train with.
+ * @return 0 on success, otherwise 1.
+ */
+int bench_dataset(const char *image_file, const char *label_file, const char *source, int threads)
+{
+    bench_image_load(image_file, label_file, source);
+
+    Dataset *dataset = image_load(image_file, label_file);
+    if (!dataset)
+    {
+        fprintf(stderr, "failed to load dataset from %s and %s\n", image_file, label_file);
+        return 1;
+    }
+    if (dataset_check_labels(dataset, BENCH_CLASSES) != 0)
+    {
+        fprintf(stderr, "dataset has labels that are not below %i\n", BENCH_CLASSES);
+        dataset_free_p(dataset);
+        return 1;
+    }
+
+    bench_training(dataset, source, threads);
+    for (int generic = 0; generic <= 1; generic++)
+    {
+        bench_inference(dataset, source, 1, generic);
+        bench_inference(dataset, source, 64, generic);
+    }
+
+    dataset_free_p(dataset);
+
+    return 0;
+}
+
+/**
+ * @brief Run all benchmarks, printing one JSON object per line. Dataset benchmarks always run on a synthetic dataset
+ * and also run on a real dataset if one is given.
+ *
+ * @param image_file file that real image data is stored in, or 0.
+ * @param label_file file that real label data is stored in, or 0.
+ * @param threads number of threads to train with.
+ * @return 0 on success, otherwise 1.
+ */
+int bench_run(const char *image_file, const char *label_file, int threads)
+{
+    const int SHAPES[][2] = {{784, 16}, {16, 16}, {16, 10}, {784, 256}, {256, 256}};
+    for (int i = 0; i < (int)(sizeof(SHAPES) / sizeof(SHAPES[0])); i++)
+        bench_kernels(SHAPES[i][0], SHAPES[i][1]);
+
+    char synthetic_images[] = "/tmp/num-identifier-bench-images-XXXXXX";
+    char synthetic_labels[] = "/tmp/num-identifier-bench-labels-XXXXXX";
+    int img_fd = mkstemp(synthetic_images);
+    int lbl_fd = mkstemp(synthetic_labels);
+    if (img_fd >= 0)
+        close(img_fd);
+    if (lbl_fd >= 0)
+        close(lbl_fd);
+
+    int res = 1;
+    if (img_fd >= 0 && lbl_fd >= 0 &&
+        bench_write_synthetic(synthetic_images, synthetic_labels, BENCH_SYNTHETIC_COUNT) == 0)
+        res = bench_dataset(synthetic_images, synthetic_labels, "synthetic", threads);
+    else
+        fprintf(stderr, "failed to write synthetic dataset\n");
+
+    if (img_fd >= 0)
+        unlink(synthetic_images);
+    if (lbl_fd >= 0)
+        unlink(synthetic_labels);
+
+    if (image_file && label_file)
+        res = bench_dataset(image_file, label_file, "idx", threads) || res;
+
+    return res;
+}
\ No newline at end of file
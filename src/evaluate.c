@@ -0,0 +1,158 @@
+#include <evaluate.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <math_ext.h>
+#include <predict.h>
+
+/**
+ * @brief State for a single worker thread of an evaluation.
+ */
+typedef struct
+{
+    Neural_Net *network;
+    Dataset *dataset;
+    int chunk_size;
+    atomic_int *next_image;
+    int *confusion;
+} Evaluate_Worker;
+
+/**
+ * @brief Entry point of an evaluation worker. Runs chunks of the dataset through the network as batches until there
+ * are none left, counting each prediction in the worker's confusion matrix.
+ *
+ * @param arg worker to run.
+ * @return nothing.
+ */
+void *evaluate_worker_run(void *arg)
+{
+    Evaluate_Worker *worker = arg;
+    Neural_Net *network = worker->network;
+    Dataset *dataset = worker->dataset;
+    const int classes = network->biases[network->layers - 1].size;
+
+    Predictor predictor = predictor_malloc(network, worker->chunk_size);
+    Matrix input = matrix_malloc(network->weights[0].width, worker->chunk_size);
+    int *labels = malloc(sizeof(int) * worker->chunk_size);
+
+    int offset;
+    while ((offset = atomic_fetch_add(worker->next_image, worker->chunk_size)) < dataset->count)
+    {
+        const int count = MIN(worker->chunk_size, dataset->count - offset);
+
+        input.height = count;
+        for (int n = 0; n < count; n++)
+            image_convert(input.values + n * input.width, dataset_image(dataset, offset + n));
+
+        network_predict_batch(&predictor, &input, labels);
+
+        for (int n = 0; n < count; n++)
+            worker->confusion[dataset_image(dataset, offset + n)->label * classes + labels[n]]++;
+    }
+
+    predictor_free(predictor);
+    matrix_free(input);
+    free(labels);
+
+    return 0;
+}
+
+/**
+ * @brief Evaluate how well a network classifies a dataset, running forward passes only and sharing the dataset between
+ * worker threads.
+ *
+ * @param network network to evaluate.
+ * @param dataset dataset to evaluate with.
+ * @param threads number of threads to use.
+ * @return the evaluation, which must be freed with evaluation_free.
+ */
+Evaluation network_evaluate(Neural_Net *network, Dataset *dataset, int threads)
+{
+    const int CHUNK_SIZE = 64;
+
+    threads = MAX(1, MIN(threads, (dataset->count + CHUNK_SIZE - 1) / CHUNK_SIZE));
+
+    Evaluation res;
+    res.count = dataset->count;
+    res.correct = 0;
+    res.classes = network->biases[network->layers - 1].size;
+    res.confusion = calloc(res.classes * res.classes, sizeof(int));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    atomic_int next_image = 0;
+    Evaluate_Worker *workers = malloc(sizeof(Evaluate_Worker) * threads);
+    pthread_t *handles = malloc(sizeof(pthread_t) * threads);
+    for (int t = 0; t < threads; t++)
+    {
+        workers[t].network = network;
+        workers[t].dataset = dataset;
+        workers[t].chunk_size = CHUNK_SIZE;
+        workers[t].next_image = &next_image;
+        workers[t].confusion = calloc(res.classes * res.classes, sizeof(int));
+    }
+
+    // The calling thread acts as the first worker. Workers share the dataset a chunk at a time, so if a thread cannot be
+    // started its part is done by the workers that did start.
+    int started = 1;
+    while (started < threads && pthread_create(handles + started, 0, evaluate_worker_run, workers + started) == 0)
+        started++;
+    evaluate_worker_run(workers);
+    for (int t = 1; t < started; t++)
+        pthread_join(handles[t], 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    res.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    // Combine the workers' confusion matrices
+    for (int t = 0; t < threads; t++)
+    {
+        for (int i = 0; i < res.classes * res.classes; i++)
+            res.confusion[i] += workers[t].confusion[i];
+        free(workers[t].confusion);
+    }
+    for (int i = 0; i < res.classes; i++)
+        res.correct += res.confusion[i * res.classes + i];
+
+    free(workers);
+    free(handles);
+
+    return res;
+}
+
+/**
+ * @brief Frees memory used by an evaluation.
+ *
+ * @param e evaluation to free memory of.
+ */
+void evaluation_free(Evaluation e)
+{
+    free(e.confusion);
+}
+
+/**
+ * @brief Print the results of an evaluation. Rows of the confusion matrix are the actual labels and columns are the
+ * predicted labels.
+ *
+ * @param e evaluation to print.
+ */
+void evaluation_print(Evaluation *e)
+{
+    printf("Accuracy: %i out of %i (%.2f%%)\n", e->correct, e->count, 100.0 * e->correct / e->count);
+    printf("Throughput: %.0f images/sec (%.3f s)\n", e->count / e->seconds, e->seconds);
+
+    printf("\nConfusion matrix (rows actual, columns predicted):\n     ");
+    for (int j = 0; j < e->classes; j++)
+        printf(" %6i", j);
+    printf("\n");
+    for (int i = 0; i < e->classes; i++)
+    {
+        printf("%4i ", i);
+        for (int j = 0; j < e->classes; j++)
+            printf(" %6i", e->confusion[i * e->classes + j]);
+        printf("\n");
+    }
+}
\ No newline at end of file
@@ -2,130 +2,337 @@
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define IMAGE_MAGIC 2051
+#define LABEL_MAGIC 2049
 
 /**
- * @brief Frees memory used by an image.
+ * @brief Frees memory used by a dataset. Only datasets returned by image_load own the mapped files and only datasets
+ * returned by stream_dataset_malloc own their pixels, subsets just refer to them.
  *
- * @param i image to free memory of.
+ * @param d dataset to free memory of.
  */
-void image_free(Image i)
+void dataset_free(Dataset d)
 {
-    free(i.data);
+    if (d.image_map)
+        munmap(d.image_map, d.image_map_size);
+    if (d.label_map)
+        munmap(d.label_map, d.label_map_size);
+    free(d.images);
+    free(d.sparse_indices);
+    free(d.sparse_values);
+    free(d.pixels);
 }
 
 /**
- * @brief Frees memory used by a image and frees the dataset itself.
+ * @brief Frees memory used by a dataset and frees the dataset itself.
  *
- * @param i image to free memory of.
+ * @param d dataset to free memory of.
  */
-void image_free_p(Image *i)
+void dataset_free_p(Dataset *d)
 {
-    image_free(*i);
-    free(i);
+    dataset_free(*d);
+    free(d);
 }
 
 /**
- * @brief Frees memory used by a dataset.
+ * @brief Map a file into memory as read only.
  *
- * @param d dataset to free memory of.
+ * @param file file to map.
+ * @param size place to store the size of the mapping.
+ * @return start of the mapping, or 0 if the file could not be mapped.
  */
-void dataset_free(Dataset d)
+void *image_map_file(const char *file, size_t *size)
 {
-    for (int i = 0; i < d.count; i++)
-        image_free(d.images[i]);
-    free(d.images);
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    // Start reading the file in the background without waiting for it
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    *size = st.st_size;
+    return map;
 }
 
 /**
- * @brief Frees memory used by a dataset and frees the dataset itself.
+ * @brief Read a big endian 32 bit integer from an IDX header.
  *
- * @param d dataset to free memory of.
+ * @param header header to read from.
+ * @param index index of the integer in the header.
+ * @return the integer.
  */
-void dataset_free_p(Dataset *d)
+int32_t image_read_header(const uint8_t *header, int index)
 {
-    dataset_free(*d);
-    free(d);
+    int32_t value;
+    memcpy(&value, header + index * sizeof(int32_t), sizeof(int32_t));
+
+    return ntohl(value);
 }
 
 /**
- * @brief Create a new dataset from files.
+ * @brief Create a new dataset from files. The files are mapped into memory and the images refer to the pixels in the
+ * mapping directly, so nothing is read until it is used.
  *
  * @param image_file file that the image data is stored in.
  * @param label_file file that the label data is stored in.
- * @return a new dataset with the data from the specifed files.
+ * @return a new dataset with the data from the specifed files, or 0 if the files could not be loaded.
  */
 Dataset *image_load(const char *image_file, const char *label_file)
 {
-    FILE *img_f, *lbl_f;
-
-    // Open files
-    img_f = fopen(image_file, "r");
-    lbl_f = fopen(label_file, "r");
+    const size_t IMAGE_HEADER_SIZE = 4 * sizeof(int32_t);
+    const size_t LABEL_HEADER_SIZE = 2 * sizeof(int32_t);
 
-    // Skip first 4 bytes
-    fseek(img_f, 4, SEEK_SET);
-    fseek(lbl_f, 4, SEEK_SET);
+    size_t img_size, lbl_size;
+    uint8_t *img_map = image_map_file(image_file, &img_size);
+    uint8_t *lbl_map = image_map_file(label_file, &lbl_size);
+    if (!img_map || !lbl_map || img_size < IMAGE_HEADER_SIZE || lbl_size < LABEL_HEADER_SIZE)
+        goto error;
 
     // Read meta data
-    int32_t count, count2, rows, cols, size;
-    fread(&count, sizeof(int32_t), 1, img_f);
-    fread(&count2, sizeof(int32_t), 1, lbl_f);
-    fread(&rows, sizeof(int32_t), 1, img_f);
-    fread(&cols, sizeof(int32_t), 1, img_f);
-    count = htonl(count);
-    count2 = htonl(count2);
-    rows = htonl(rows);
-    cols = htonl(cols);
-    size = rows * cols;
-
-    // Check counts match
-    if (count != count2)
-    {
-        fclose(img_f);
-        fclose(lbl_f);
-        return 0;
-    }
+    if (image_read_header(img_map, 0) != IMAGE_MAGIC || image_read_header(lbl_map, 0) != LABEL_MAGIC)
+        goto error;
+
+    int32_t count = image_read_header(img_map, 1);
+    int32_t count2 = image_read_header(lbl_map, 1);
+    int32_t rows = image_read_header(img_map, 2);
+    int32_t cols = image_read_header(img_map, 3);
+
+    // Check the image size fits in an int before working it out, so a corrupt header cannot overflow it
+    if (rows <= 0 || cols <= 0 || (int64_t)rows * cols > INT32_MAX)
+        goto error;
+    int32_t size = rows * cols;
 
-    // Load images data and lables
+    // Check counts match and files are large enough
+    if (count != count2 || count <= 0 || (img_size - IMAGE_HEADER_SIZE) / size < (size_t)count ||
+        lbl_size < LABEL_HEADER_SIZE + (size_t)count)
+        goto error;
+
+    // Point images at their data and read labels
     Image *images = malloc(sizeof(Image) * count);
-    uint8_t *buffer = malloc(sizeof(uint8_t) * size);
+    if (!images)
+        goto error;
+    const uint8_t *pixels = img_map + IMAGE_HEADER_SIZE;
+    const uint8_t *labels = lbl_map + LABEL_HEADER_SIZE;
     for (int i = 0; i < count; i++)
     {
         images[i].size = size;
-        fread(buffer, sizeof(uint8_t), size, img_f);
-        images[i].data = malloc(sizeof(double) * size);
-        for (int j = 0; j < size; j++)
-            images[i].data[j] = buffer[j] / 255.0;
-
-        images[i].label = 0;
-        fread(&images[i].label, sizeof(uint8_t), 1, lbl_f);
+        images[i].data = pixels + (size_t)i * size;
+        images[i].label = labels[i];
+        images[i].nonzero_count = 0;
+        images[i].nonzero_indices = 0;
+        images[i].nonzero_values = 0;
     }
-    free(buffer);
-
-    fclose(img_f);
-    fclose(lbl_f);
 
     Dataset *res = malloc(sizeof(Dataset));
     res->images = images;
+    res->indices = 0;
     res->count = count;
+    res->image_map = img_map;
+    res->image_map_size = img_size;
+    res->label_map = lbl_map;
+    res->label_map_size = lbl_size;
+    res->sparse_indices = 0;
+    res->sparse_values = 0;
+    res->pixels = 0;
 
     return res;
+
+error:
+    if (img_map)
+        munmap(img_map, img_size);
+    if (lbl_map)
+        munmap(lbl_map, lbl_size);
+    return 0;
+}
+
+/**
+ * @brief Store the nonzero pixels of each image in a dataset as (index, value) pairs, so that work on pixels that are
+ * zero can be skipped. The pairs for all the images are stored together and owned by the dataset.
+ *
+ * @param dataset dataset to sparsify, which must be one returned by image_load or stream_dataset_malloc.
+ * @return 0 if successful, otherwise -1.
+ */
+int dataset_sparsify(Dataset *dataset)
+{
+    if (dataset->sparse_indices)
+        return 0;
+
+    size_t total = 0;
+    for (int i = 0; i < dataset->count; i++)
+        for (int j = 0; j < dataset->images[i].size; j++)
+            total += dataset->images[i].data[j] != 0;
+
+    int32_t *indices = malloc(sizeof(int32_t) * (total + 1));
+    uint8_t *values = malloc(total + 1);
+    if (!indices || !values)
+    {
+        free(indices);
+        free(values);
+        return -1;
+    }
+
+    size_t offset = 0;
+    for (int i = 0; i < dataset->count; i++)
+    {
+        Image *image = dataset->images + i;
+        image->nonzero_indices = indices + offset;
+        image->nonzero_values = values + offset;
+        for (int j = 0; j < image->size; j++)
+        {
+            if (image->data[j] != 0)
+            {
+                indices[offset] = j;
+                values[offset] = image->data[j];
+                offset++;
+            }
+        }
+        image->nonzero_count = (indices + offset) - image->nonzero_indices;
+    }
+
+    dataset->sparse_indices = indices;
+    dataset->sparse_values = values;
+
+    return 0;
+}
+
+/**
+ * @brief Convert the pixels of an image to values between 0 and 1.
+ *
+ * @param dest place to store the values, with room for the size of the image.
+ * @param image image to convert.
+ */
+void image_convert(real *dest, const Image *image)
+{
+    const real SCALE = 1 / 255.0;
+    for (int i = 0; i < image->size; i++)
+        dest[i] = image->data[i] * SCALE;
+}
+
+/**
+ * @brief Convert the nonzero pixels of an image to values between 0 and 1. The values line up with the indices of the
+ * nonzero pixels stored in the image.
+ *
+ * @param dest place to store the values, with room for the number of nonzero pixels in the image.
+ * @param image image to convert, which must have been sparsified.
+ * @return number of values stored.
+ */
+int image_convert_sparse(real *dest, const Image *image)
+{
+    const real SCALE = 1 / 255.0;
+    for (int i = 0; i < image->nonzero_count; i++)
+        dest[i] = image->nonzero_values[i] * SCALE;
+
+    return image->nonzero_count;
 }
 
 /**
- * @brief Randomize the order of images in a dataset.
+ * @brief Check that every label of a dataset is the index of one of a network's outputs. Labels are read straight from
+ * the file, so this must pass before they are used as indices.
  *
- * @param dataset dataset to randomize the order of.
+ * @param dataset dataset to check.
+ * @param classes number of outputs of the network.
+ * @return 0 if every label is below classes, otherwise -1.
  */
-void image_randomize_order(Dataset *dataset)
+int dataset_check_labels(const Dataset *dataset, int classes)
 {
-    for (int i = dataset->count - 1; i > 0; i--)
+    for (int i = 0; i < dataset->count; i++)
     {
-        int j = rand() % (i + 1);
-        Image temp = dataset->images[i];
-        dataset->images[i] = dataset->images[j];
-        dataset->images[j] = temp;
+        if (dataset->images[i].label >= classes)
+            return -1;
     }
+
+    return 0;
+}
+
+/**
+ * @brief Get an image from a dataset.
+ *
+ * @param dataset dataset to get the image from.
+ * @param i index of the image in the dataset.
+ * @return the image.
+ */
+const Image *dataset_image(const Dataset *dataset, int i)
+{
+    if (dataset->indices)
+        return dataset->images + dataset->indices[i];
+
+    return dataset->images + i;
+}
+
+/**
+ * @brief Allocate an order for the images of a dataset, starting as the order of the dataset itself.
+ *
+ * @param dataset dataset to create the order for.
+ * @return array with an index for each image in the dataset.
+ */
+int *dataset_order_malloc(const Dataset *dataset)
+{
+    int *order = malloc(sizeof(int) * dataset->count);
+    for (int i = 0; i < dataset->count; i++)
+        order[i] = i;
+
+    return order;
+}
+
+/**
+ * @brief Randomize an order of images.
+ *
+ * @param order order to randomize.
+ * @param count number of indices in the order.
+ * @param rng random number generator to shuffle with.
+ */
+void dataset_shuffle_order(int *order, int count, Rng *rng)
+{
+    for (int i = count - 1; i > 0; i--)
+    {
+        int j = rnd_below(rng, i + 1);
+        int temp = order[i];
+        order[i] = order[j];
+        order[j] = temp;
+    }
+}
+
+/**
+ * @brief Create a new dataset that refers to the images of another dataset in a different order. The images are not
+ * moved, so any number of views can share one dataset.
+ *
+ * @param dataset dataset to view, which must not itself be a view with an order.
+ * @param order index into the dataset for each image of the view.
+ * @return a view of the dataset.
+ */
+Dataset *dataset_view(Dataset *dataset, int *order)
+{
+    Dataset *res = malloc(sizeof(Dataset));
+    res->count = dataset->count;
+    res->images = dataset->images;
+    res->indices = order;
+    res->image_map = 0;
+    res->image_map_size = 0;
+    res->label_map = 0;
+    res->label_map_size = 0;
+    res->sparse_indices = 0;
+    res->sparse_values = 0;
+    res->pixels = 0;
+
+    return res;
 }
 
 /**
@@ -140,7 +347,23 @@ Dataset *dataset_subset(Dataset *dataset, int offset, int count)
 {
     Dataset *res = malloc(sizeof(Dataset));
     res->count = count;
-    res->images = (dataset->images) + offset;
+    if (dataset->indices)
+    {
+        res->images = dataset->images;
+        res->indices = dataset->indices + offset;
+    }
+    else
+    {
+        res->images = (dataset->images) + offset;
+        res->indices = 0;
+    }
+    res->image_map = 0;
+    res->image_map_size = 0;
+    res->label_map = 0;
+    res->label_map_size = 0;
+    res->sparse_indices = 0;
+    res->sparse_values = 0;
+    res->pixels = 0;
 
     return res;
 }
\ No newline at end of file
@@ -0,0 +1,917 @@
+#include <kernel.h>
+#include <immintrin.h>
+#include <math.h>
+
+/*
+Each kernel has a portable scalar version and versions for x86 vector extensions. kernel_init checks which extensions
+the CPU supports and points all the kernels at the best versions, so calls only pay for an indirect call. It is called
+once at startup, before any threads exist, so the kernels never see the choice change.
+*/
+
+/*
+The vector versions are written in terms of these macros so the same code works on either precision. LANES_256 and
+LANES_512 are the number of values that fit in each register size.
+*/
+#ifdef SINGLE_PRECISION
+#define LANES_256 8
+#define LANES_512 16
+#define VEC_256 __m256
+#define VEC_512 __m512
+#define ZERO_256 _mm256_setzero_ps
+#define ZERO_512 _mm512_setzero_ps
+#define SET1_256 _mm256_set1_ps
+#define SET1_512 _mm512_set1_ps
+#define LOAD_256 _mm256_loadu_ps
+#define LOAD_512 _mm512_loadu_ps
+#define STORE_256 _mm256_storeu_ps
+#define STORE_512 _mm512_storeu_ps
+#define ADD_256 _mm256_add_ps
+#define ADD_512 _mm512_add_ps
+#define SUB_256 _mm256_sub_ps
+#define SUB_512 _mm512_sub_ps
+#define FMADD_256 _mm256_fmadd_ps
+#define FMADD_512 _mm512_fmadd_ps
+#define REDUCE_512 _mm512_reduce_add_ps
+#define MUL_256 _mm256_mul_ps
+#define MUL_512 _mm512_mul_ps
+#define DIV_256 _mm256_div_ps
+#define DIV_512 _mm512_div_ps
+#define MIN_256 _mm256_min_ps
+#define MIN_512 _mm512_min_ps
+#define MAX_256 _mm256_max_ps
+#define MAX_512 _mm512_max_ps
+#define FNMADD_256 _mm256_fnmadd_ps
+#define FNMADD_512 _mm512_fnmadd_ps
+#define ROUND_256 _mm256_round_ps
+#define ROUND_512 _mm512_roundscale_ps
+#define SCALEF_512 _mm512_scalef_ps
+#else
+#define LANES_256 4
+#define LANES_512 8
+#define VEC_256 __m256d
+#define VEC_512 __m512d
+#define ZERO_256 _mm256_setzero_pd
+#define ZERO_512 _mm512_setzero_pd
+#define SET1_256 _mm256_set1_pd
+#define SET1_512 _mm512_set1_pd
+#define LOAD_256 _mm256_loadu_pd
+#define LOAD_512 _mm512_loadu_pd
+#define STORE_256 _mm256_storeu_pd
+#define STORE_512 _mm512_storeu_pd
+#define ADD_256 _mm256_add_pd
+#define ADD_512 _mm512_add_pd
+#define SUB_256 _mm256_sub_pd
+#define SUB_512 _mm512_sub_pd
+#define FMADD_256 _mm256_fmadd_pd
+#define FMADD_512 _mm512_fmadd_pd
+#define REDUCE_512 _mm512_reduce_add_pd
+#define MUL_256 _mm256_mul_pd
+#define MUL_512 _mm512_mul_pd
+#define DIV_256 _mm256_div_pd
+#define DIV_512 _mm512_div_pd
+#define MIN_256 _mm256_min_pd
+#define MIN_512 _mm512_min_pd
+#define MAX_256 _mm256_max_pd
+#define MAX_512 _mm512_max_pd
+#define FNMADD_256 _mm256_fnmadd_pd
+#define FNMADD_512 _mm512_fnmadd_pd
+#define ROUND_256 _mm256_round_pd
+#define ROUND_512 _mm512_roundscale_pd
+#define SCALEF_512 _mm512_scalef_pd
+#endif
+
+/*
+The sigmoid kernels calculate exp(t) as 2^k * exp(r), where k is t / ln(2) rounded to an integer and |r| <= ln(2) / 2,
+so that a short Taylor series is enough for exp(r). ln(2) is split into a high part that is exact when multiplied by k
+and a low correction. Inputs are clamped to a range where neither exp(t) nor 2^k overflows, which does not change the
+result as the sigmoid has already saturated there. The series is long enough that the relative error of the result is
+below 1e-15 in double precision and 1e-6 in single precision.
+*/
+#ifdef SINGLE_PRECISION
+#define EXP_DEGREE 7
+#define EXP_CLAMP 80.0f
+#define EXP_LOG2E 1.44269504088896341f
+#define EXP_LN2_HI 0.693359375f
+#define EXP_LN2_LO -2.12194440e-4f
+#else
+#define EXP_DEGREE 12
+#define EXP_CLAMP 700.0
+#define EXP_LOG2E 1.44269504088896338700e+00
+#define EXP_LN2_HI 6.93147180369123816490e-01
+#define EXP_LN2_LO 1.90821492927058770002e-10
+#endif
+
+static const real EXP_COEFFS[13] = {1.0,
+                                    1.0,
+                                    1.0 / 2,
+                                    1.0 / 6,
+                                    1.0 / 24,
+                                    1.0 / 120,
+                                    1.0 / 720,
+                                    1.0 / 5040,
+                                    1.0 / 40320,
+                                    1.0 / 362880,
+                                    1.0 / 3628800,
+                                    1.0 / 39916800,
+                                    1.0 / 479001600};
+
+/**
+ * @brief Calculate the dot product of two arrays.
+ *
+ * @param a first array.
+ * @param b second array.
+ * @param n number of values in each array.
+ * @return dot product.
+ */
+real kernel_dot_scalar(const real *a, const real *b, int n)
+{
+    real sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += a[i] * b[i];
+
+    return sum;
+}
+
+/**
+ * @brief Calculate the dot products of four consecutive rows with one array.
+ *
+ * @param dest place to store the four dot products.
+ * @param a first row.
+ * @param stride distance between the start of each row.
+ * @param b array to multiply each row by.
+ * @param n number of values in each row.
+ */
+void kernel_dot4_scalar(real *dest, const real *a, int stride, const real *b, int n)
+{
+    const real *a0 = a, *a1 = a + stride, *a2 = a + 2 * stride, *a3 = a + 3 * stride;
+    real s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (int i = 0; i < n; i++)
+    {
+        s0 += a0[i] * b[i];
+        s1 += a1[i] * b[i];
+        s2 += a2[i] * b[i];
+        s3 += a3[i] * b[i];
+    }
+
+    dest[0] = s0;
+    dest[1] = s1;
+    dest[2] = s2;
+    dest[3] = s3;
+}
+
+/**
+ * @brief Add a scaled array to another array (y += scale * x).
+ *
+ * @param y array to add to.
+ * @param scale value to multiply x by.
+ * @param x array to scale and add.
+ * @param n number of values in each array.
+ */
+void kernel_axpy_scalar(real *y, real scale, const real *x, int n)
+{
+    for (int i = 0; i < n; i++)
+        y[i] += scale * x[i];
+}
+
+/**
+ * @brief Add an array scaled by four values to four rows of a matrix (dest_k += scales_k * x), and add four rows of
+ * another matrix scaled by the same values to an array (y += scales_k * rows_k, in order of k).
+ *
+ * @param dest first of the four rows to add to.
+ * @param y array to add to.
+ * @param x array to scale and add to each row of dest.
+ * @param rows first of the four rows to scale and add to y.
+ * @param stride distance between consecutive rows of dest and of rows.
+ * @param scales four values to multiply by.
+ * @param n number of values in x, y and each row.
+ */
+void kernel_outer_axpy4_scalar(real *dest, real *y, const real *x, const real *rows, int stride, const real *scales,
+                               int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        real sum = y[i];
+        for (int k = 0; k < 4; k++)
+        {
+            dest[k * stride + i] += scales[k] * x[i];
+            sum += scales[k] * rows[k * stride + i];
+        }
+        y[i] = sum;
+    }
+}
+
+/**
+ * @brief Add rows of a matrix, each scaled by four values, to four rows of another matrix (dest_k += scales_mk * x_m
+ * summed over m, in order of m).
+ *
+ * @param dest first of the four rows to add to.
+ * @param x first row to scale and add.
+ * @param stride distance between consecutive rows of dest and of x.
+ * @param count number of rows of x.
+ * @param scales values to multiply by, with scales_mk at scales[m * scale_stride + k * scale_step].
+ * @param scale_stride distance between the values for consecutive rows of x.
+ * @param scale_step distance between the values for consecutive rows of dest.
+ * @param n number of values in each row.
+ */
+void kernel_matrix_axpy4_scalar(real *dest, const real *x, int stride, int count, const real *scales, int scale_stride,
+                                int scale_step, int n)
+{
+    for (int k = 0; k < 4; k++)
+    {
+        real *d = dest + k * stride;
+        for (int m = 0; m < count; m++)
+        {
+            const real scale = scales[m * scale_stride + k * scale_step];
+            const real *row = x + (size_t)m * stride;
+            for (int i = 0; i < n; i++)
+                d[i] += scale * row[i];
+        }
+    }
+}
+
+/**
+ * @brief Add scaled rows of a matrix, picked by index, to an array (y += sum of x_i * rows[indices_i]).
+ *
+ * @param y array to add to.
+ * @param rows matrix to pick rows from.
+ * @param n number of values in y and in each row.
+ * @param indices index of each row to add.
+ * @param x value to multiply each row by.
+ * @param count number of rows to add.
+ */
+void kernel_gather_axpy_scalar(real *y, const real *rows, int n, const int32_t *indices, const real *x, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const real *row = rows + (size_t)indices[i] * n;
+        for (int j = 0; j < n; j++)
+            y[j] += x[i] * row[j];
+    }
+}
+
+/**
+ * @brief Add a scaled array to rows of a matrix picked by index (rows[indices_i] += x_i * v).
+ *
+ * @param rows matrix to add to.
+ * @param n number of values in v and in each row.
+ * @param indices index of each row to add to, with no index repeated.
+ * @param x value to multiply v by for each row.
+ * @param count number of rows to add to.
+ * @param v array to scale and add.
+ */
+void kernel_scatter_axpy_scalar(real *rows, int n, const int32_t *indices, const real *x, int count, const real *v)
+{
+    for (int i = 0; i < count; i++)
+    {
+        real *row = rows + (size_t)indices[i] * n;
+        for (int j = 0; j < n; j++)
+            row[j] += x[i] * v[j];
+    }
+}
+
+/**
+ * @brief Apply the sigmoid function to each value of an array.
+ *
+ * @param dest array to store the results in, which may be the same as src.
+ * @param src array of values to apply the sigmoid function to.
+ * @param n number of values in each array.
+ */
+void kernel_sigmoid_scalar(real *dest, const real *src, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        real t = -src[i];
+        t = t < -EXP_CLAMP ? -EXP_CLAMP : (t > EXP_CLAMP ? EXP_CLAMP : t);
+
+        real k = rint(t * EXP_LOG2E);
+        real r = t - k * EXP_LN2_HI - k * EXP_LN2_LO;
+
+        real p = EXP_COEFFS[EXP_DEGREE];
+        for (int c = EXP_DEGREE - 1; c >= 0; c--)
+            p = p * r + EXP_COEFFS[c];
+
+        dest[i] = 1 / (1 + ldexp(p, (int)k));
+    }
+}
+
+__attribute__((target("avx2,fma"))) real kernel_hsum_avx2(VEC_256 v)
+{
+#ifdef SINGLE_PRECISION
+    __m128 low = _mm256_castps256_ps128(v);
+    __m128 high = _mm256_extractf128_ps(v, 1);
+    low = _mm_add_ps(low, high);
+    low = _mm_add_ps(low, _mm_movehl_ps(low, low));
+
+    return _mm_cvtss_f32(_mm_add_ss(low, _mm_shuffle_ps(low, low, 1)));
+#else
+    __m128d low = _mm256_castpd256_pd128(v);
+    __m128d high = _mm256_extractf128_pd(v, 1);
+    low = _mm_add_pd(low, high);
+
+    return _mm_cvtsd_f64(_mm_add_sd(low, _mm_unpackhi_pd(low, low)));
+#endif
+}
+
+__attribute__((target("avx2,fma"))) real kernel_dot_avx2(const real *a, const real *b, int n)
+{
+    VEC_256 s0 = ZERO_256(), s1 = ZERO_256();
+    int i = 0;
+    for (; i + 2 * LANES_256 <= n; i += 2 * LANES_256)
+    {
+        s0 = FMADD_256(LOAD_256(a + i), LOAD_256(b + i), s0);
+        s1 = FMADD_256(LOAD_256(a + i + LANES_256), LOAD_256(b + i + LANES_256), s1);
+    }
+    for (; i + LANES_256 <= n; i += LANES_256)
+        s0 = FMADD_256(LOAD_256(a + i), LOAD_256(b + i), s0);
+
+    real sum = kernel_hsum_avx2(ADD_256(s0, s1));
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+
+    return sum;
+}
+
+__attribute__((target("avx2,fma"))) void kernel_dot4_avx2(real *dest, const real *a, int stride, const real *b, int n)
+{
+    const real *a0 = a, *a1 = a + stride, *a2 = a + 2 * stride, *a3 = a + 3 * stride;
+    VEC_256 s0 = ZERO_256(), s1 = ZERO_256(), s2 = ZERO_256(), s3 = ZERO_256();
+    int i = 0;
+    for (; i + LANES_256 <= n; i += LANES_256)
+    {
+        VEC_256 bv = LOAD_256(b + i);
+        s0 = FMADD_256(LOAD_256(a0 + i), bv, s0);
+        s1 = FMADD_256(LOAD_256(a1 + i), bv, s1);
+        s2 = FMADD_256(LOAD_256(a2 + i), bv, s2);
+        s3 = FMADD_256(LOAD_256(a3 + i), bv, s3);
+    }
+
+    dest[0] = kernel_hsum_avx2(s0);
+    dest[1] = kernel_hsum_avx2(s1);
+    dest[2] = kernel_hsum_avx2(s2);
+    dest[3] = kernel_hsum_avx2(s3);
+    for (; i < n; i++)
+    {
+        dest[0] += a0[i] * b[i];
+        dest[1] += a1[i] * b[i];
+        dest[2] += a2[i] * b[i];
+        dest[3] += a3[i] * b[i];
+    }
+}
+
+__attribute__((target("avx2,fma"))) void kernel_axpy_avx2(real *y, real scale, const real *x, int n)
+{
+    VEC_256 s = SET1_256(scale);
+    int i = 0;
+    for (; i + LANES_256 <= n; i += LANES_256)
+        STORE_256(y + i, FMADD_256(s, LOAD_256(x + i), LOAD_256(y + i)));
+    for (; i < n; i++)
+        y[i] += scale * x[i];
+}
+
+__attribute__((target("avx2,fma"))) void kernel_outer_axpy4_avx2(real *dest, real *y, const real *x, const real *rows,
+                                                                 int stride, const real *scales, int n)
+{
+    VEC_256 s0 = SET1_256(scales[0]), s1 = SET1_256(scales[1]), s2 = SET1_256(scales[2]), s3 = SET1_256(scales[3]);
+    int i = 0;
+    for (; i + LANES_256 <= n; i += LANES_256)
+    {
+        VEC_256 xi = LOAD_256(x + i);
+        STORE_256(dest + i, FMADD_256(s0, xi, LOAD_256(dest + i)));
+        STORE_256(dest + stride + i, FMADD_256(s1, xi, LOAD_256(dest + stride + i)));
+        STORE_256(dest + 2 * stride + i, FMADD_256(s2, xi, LOAD_256(dest + 2 * stride + i)));
+        STORE_256(dest + 3 * stride + i, FMADD_256(s3, xi, LOAD_256(dest + 3 * stride + i)));
+
+        // y is loaded and stored once for all four rows
+        VEC_256 sum = FMADD_256(s0, LOAD_256(rows + i), LOAD_256(y + i));
+        sum = FMADD_256(s1, LOAD_256(rows + stride + i), sum);
+        sum = FMADD_256(s2, LOAD_256(rows + 2 * stride + i), sum);
+        sum = FMADD_256(s3, LOAD_256(rows + 3 * stride + i), sum);
+        STORE_256(y + i, sum);
+    }
+    for (; i < n; i++)
+    {
+        real sum = y[i];
+        for (int k = 0; k < 4; k++)
+        {
+            dest[k * stride + i] += scales[k] * x[i];
+            sum += scales[k] * rows[k * stride + i];
+        }
+        y[i] = sum;
+    }
+}
+
+__attribute__((target("avx2,fma"))) void kernel_matrix_axpy4_avx2(real *dest, const real *x, int stride, int count,
+                                                                  const real *scales, int scale_stride, int scale_step,
+                                                                  int n)
+{
+    int i = 0;
+    // Two vectors of each of the four rows are summed in registers over all the rows of x
+    for (; i + 2 * LANES_256 <= n; i += 2 * LANES_256)
+    {
+        real *d0 = dest + i, *d1 = dest + stride + i, *d2 = dest + 2 * stride + i, *d3 = dest + 3 * stride + i;
+        VEC_256 a0 = LOAD_256(d0), a1 = LOAD_256(d0 + LANES_256), b0 = LOAD_256(d1), b1 = LOAD_256(d1 + LANES_256);
+        VEC_256 c0 = LOAD_256(d2), c1 = LOAD_256(d2 + LANES_256), e0 = LOAD_256(d3), e1 = LOAD_256(d3 + LANES_256);
+        for (int m = 0; m < count; m++)
+        {
+            const real *row = x + (size_t)m * stride + i;
+            const real *s = scales + m * scale_stride;
+            VEC_256 x0 = LOAD_256(row), x1 = LOAD_256(row + LANES_256);
+            VEC_256 s0 = SET1_256(s[0]), s1 = SET1_256(s[scale_step]);
+            VEC_256 s2 = SET1_256(s[2 * scale_step]), s3 = SET1_256(s[3 * scale_step]);
+            a0 = FMADD_256(s0, x0, a0);
+            a1 = FMADD_256(s0, x1, a1);
+            b0 = FMADD_256(s1, x0, b0);
+            b1 = FMADD_256(s1, x1, b1);
+            c0 = FMADD_256(s2, x0, c0);
+            c1 = FMADD_256(s2, x1, c1);
+            e0 = FMADD_256(s3, x0, e0);
+            e1 = FMADD_256(s3, x1, e1);
+        }
+        STORE_256(d0, a0);
+        STORE_256(d0 + LANES_256, a1);
+        STORE_256(d1, b0);
+        STORE_256(d1 + LANES_256, b1);
+        STORE_256(d2, c0);
+        STORE_256(d2 + LANES_256, c1);
+        STORE_256(d3, e0);
+        STORE_256(d3 + LANES_256, e1);
+    }
+    for (; i < n; i++)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            real sum = dest[k * stride + i];
+            for (int m = 0; m < count; m++)
+                sum += scales[m * scale_stride + k * scale_step] * x[(size_t)m * stride + i];
+            dest[k * stride + i] = sum;
+        }
+    }
+}
+
+__attribute__((target("avx2,fma"))) void kernel_gather_axpy_avx2(real *y, const real *rows, int n, const int32_t *indices,
+                                                                 const real *x, int count)
+{
+    int j = 0;
+    for (; j + LANES_256 <= n; j += LANES_256)
+    {
+        // Several sums hide the latency of each multiply-add
+        VEC_256 s0 = LOAD_256(y + j), s1 = ZERO_256(), s2 = ZERO_256(), s3 = ZERO_256();
+        int i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            s0 = FMADD_256(SET1_256(x[i]), LOAD_256(rows + (size_t)indices[i] * n + j), s0);
+            s1 = FMADD_256(SET1_256(x[i + 1]), LOAD_256(rows + (size_t)indices[i + 1] * n + j), s1);
+            s2 = FMADD_256(SET1_256(x[i + 2]), LOAD_256(rows + (size_t)indices[i + 2] * n + j), s2);
+            s3 = FMADD_256(SET1_256(x[i + 3]), LOAD_256(rows + (size_t)indices[i + 3] * n + j), s3);
+        }
+        for (; i < count; i++)
+            s0 = FMADD_256(SET1_256(x[i]), LOAD_256(rows + (size_t)indices[i] * n + j), s0);
+
+        STORE_256(y + j, ADD_256(ADD_256(s0, s1), ADD_256(s2, s3)));
+    }
+    for (; j < n; j++)
+    {
+        for (int i = 0; i < count; i++)
+            y[j] += x[i] * rows[(size_t)indices[i] * n + j];
+    }
+}
+
+__attribute__((target("avx2,fma"))) void kernel_scatter_axpy_avx2(real *rows, int n, const int32_t *indices,
+                                                                  const real *x, int count, const real *v)
+{
+    for (int i = 0; i < count; i++)
+    {
+        real *row = rows + (size_t)indices[i] * n;
+        VEC_256 s = SET1_256(x[i]);
+        int j = 0;
+        for (; j + LANES_256 <= n; j += LANES_256)
+            STORE_256(row + j, FMADD_256(s, LOAD_256(v + j), LOAD_256(row + j)));
+        for (; j < n; j++)
+            row[j] += x[i] * v[j];
+    }
+}
+
+__attribute__((target("avx2,fma"))) void kernel_sigmoid_avx2(real *dest, const real *src, int n)
+{
+    const VEC_256 clamp = SET1_256(EXP_CLAMP), one = SET1_256(1);
+    int i = 0;
+    for (; i + LANES_256 <= n; i += LANES_256)
+    {
+        VEC_256 t = SUB_256(ZERO_256(), LOAD_256(src + i));
+        t = MIN_256(MAX_256(t, SUB_256(ZERO_256(), clamp)), clamp);
+
+        VEC_256 k = ROUND_256(MUL_256(t, SET1_256(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        VEC_256 r = FNMADD_256(k, SET1_256(EXP_LN2_HI), t);
+        r = FNMADD_256(k, SET1_256(EXP_LN2_LO), r);
+
+        VEC_256 p = SET1_256(EXP_COEFFS[EXP_DEGREE]);
+        for (int c = EXP_DEGREE - 1; c >= 0; c--)
+            p = FMADD_256(p, r, SET1_256(EXP_COEFFS[c]));
+
+        // Build 2^k directly in the exponent bits
+#ifdef SINGLE_PRECISION
+        __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127)), 23);
+        p = MUL_256(p, _mm256_castsi256_ps(bits));
+#else
+        __m256i bits = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(k));
+        bits = _mm256_slli_epi64(_mm256_add_epi64(bits, _mm256_set1_epi64x(1023)), 52);
+        p = MUL_256(p, _mm256_castsi256_pd(bits));
+#endif
+
+        STORE_256(dest + i, DIV_256(one, ADD_256(one, p)));
+    }
+    kernel_sigmoid_scalar(dest + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f"))) real kernel_dot_avx512(const real *a, const real *b, int n)
+{
+    VEC_512 s0 = ZERO_512(), s1 = ZERO_512();
+    int i = 0;
+    for (; i + 2 * LANES_512 <= n; i += 2 * LANES_512)
+    {
+        s0 = FMADD_512(LOAD_512(a + i), LOAD_512(b + i), s0);
+        s1 = FMADD_512(LOAD_512(a + i + LANES_512), LOAD_512(b + i + LANES_512), s1);
+    }
+    for (; i + LANES_512 <= n; i += LANES_512)
+        s0 = FMADD_512(LOAD_512(a + i), LOAD_512(b + i), s0);
+
+    real sum = REDUCE_512(ADD_512(s0, s1));
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+
+    return sum;
+}
+
+__attribute__((target("avx512f"))) void kernel_dot4_avx512(real *dest, const real *a, int stride, const real *b, int n)
+{
+    const real *a0 = a, *a1 = a + stride, *a2 = a + 2 * stride, *a3 = a + 3 * stride;
+    VEC_512 s0 = ZERO_512(), s1 = ZERO_512(), s2 = ZERO_512(), s3 = ZERO_512();
+    int i = 0;
+    for (; i + LANES_512 <= n; i += LANES_512)
+    {
+        VEC_512 bv = LOAD_512(b + i);
+        s0 = FMADD_512(LOAD_512(a0 + i), bv, s0);
+        s1 = FMADD_512(LOAD_512(a1 + i), bv, s1);
+        s2 = FMADD_512(LOAD_512(a2 + i), bv, s2);
+        s3 = FMADD_512(LOAD_512(a3 + i), bv, s3);
+    }
+
+    dest[0] = REDUCE_512(s0);
+    dest[1] = REDUCE_512(s1);
+    dest[2] = REDUCE_512(s2);
+    dest[3] = REDUCE_512(s3);
+    for (; i < n; i++)
+    {
+        dest[0] += a0[i] * b[i];
+        dest[1] += a1[i] * b[i];
+        dest[2] += a2[i] * b[i];
+        dest[3] += a3[i] * b[i];
+    }
+}
+
+__attribute__((target("avx512f"))) void kernel_axpy_avx512(real *y, real scale, const real *x, int n)
+{
+    VEC_512 s = SET1_512(scale);
+    int i = 0;
+    for (; i + LANES_512 <= n; i += LANES_512)
+        STORE_512(y + i, FMADD_512(s, LOAD_512(x + i), LOAD_512(y + i)));
+    for (; i < n; i++)
+        y[i] += scale * x[i];
+}
+
+__attribute__((target("avx512f"))) void kernel_outer_axpy4_avx512(real *dest, real *y, const real *x, const real *rows,
+                                                                  int stride, const real *scales, int n)
+{
+    VEC_512 s0 = SET1_512(scales[0]), s1 = SET1_512(scales[1]), s2 = SET1_512(scales[2]), s3 = SET1_512(scales[3]);
+    int i = 0;
+    for (; i + LANES_512 <= n; i += LANES_512)
+    {
+        VEC_512 xi = LOAD_512(x + i);
+        STORE_512(dest + i, FMADD_512(s0, xi, LOAD_512(dest + i)));
+        STORE_512(dest + stride + i, FMADD_512(s1, xi, LOAD_512(dest + stride + i)));
+        STORE_512(dest + 2 * stride + i, FMADD_512(s2, xi, LOAD_512(dest + 2 * stride + i)));
+        STORE_512(dest + 3 * stride + i, FMADD_512(s3, xi, LOAD_512(dest + 3 * stride + i)));
+
+        // y is loaded and stored once for all four rows
+        VEC_512 sum = FMADD_512(s0, LOAD_512(rows + i), LOAD_512(y + i));
+        sum = FMADD_512(s1, LOAD_512(rows + stride + i), sum);
+        sum = FMADD_512(s2, LOAD_512(rows + 2 * stride + i), sum);
+        sum = FMADD_512(s3, LOAD_512(rows + 3 * stride + i), sum);
+        STORE_512(y + i, sum);
+    }
+    for (; i < n; i++)
+    {
+        real sum = y[i];
+        for (int k = 0; k < 4; k++)
+        {
+            dest[k * stride + i] += scales[k] * x[i];
+            sum += scales[k] * rows[k * stride + i];
+        }
+        y[i] = sum;
+    }
+}
+
+__attribute__((target("avx512f"))) void kernel_matrix_axpy4_avx512(real *dest, const real *x, int stride,
+                                                                   int count, const real *scales, int scale_stride,
+                                                                   int scale_step, int n)
+{
+    int i = 0;
+    // Two vectors of each of the four rows are summed in registers over all the rows of x
+    for (; i + 2 * LANES_512 <= n; i += 2 * LANES_512)
+    {
+        real *d0 = dest + i, *d1 = dest + stride + i, *d2 = dest + 2 * stride + i, *d3 = dest + 3 * stride + i;
+        VEC_512 a0 = LOAD_512(d0), a1 = LOAD_512(d0 + LANES_512), b0 = LOAD_512(d1), b1 = LOAD_512(d1 + LANES_512);
+        VEC_512 c0 = LOAD_512(d2), c1 = LOAD_512(d2 + LANES_512), e0 = LOAD_512(d3), e1 = LOAD_512(d3 + LANES_512);
+        for (int m = 0; m < count; m++)
+        {
+            const real *row = x + (size_t)m * stride + i;
+            const real *s = scales + m * scale_stride;
+            VEC_512 x0 = LOAD_512(row), x1 = LOAD_512(row + LANES_512);
+            VEC_512 s0 = SET1_512(s[0]), s1 = SET1_512(s[scale_step]);
+            VEC_512 s2 = SET1_512(s[2 * scale_step]), s3 = SET1_512(s[3 * scale_step]);
+            a0 = FMADD_512(s0, x0, a0);
+            a1 = FMADD_512(s0, x1, a1);
+            b0 = FMADD_512(s1, x0, b0);
+            b1 = FMADD_512(s1, x1, b1);
+            c0 = FMADD_512(s2, x0, c0);
+            c1 = FMADD_512(s2, x1, c1);
+            e0 = FMADD_512(s3, x0, e0);
+            e1 = FMADD_512(s3, x1, e1);
+        }
+        STORE_512(d0, a0);
+        STORE_512(d0 + LANES_512, a1);
+        STORE_512(d1, b0);
+        STORE_512(d1 + LANES_512, b1);
+        STORE_512(d2, c0);
+        STORE_512(d2 + LANES_512, c1);
+        STORE_512(d3, e0);
+        STORE_512(d3 + LANES_512, e1);
+    }
+    for (; i < n; i++)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            real sum = dest[k * stride + i];
+            for (int m = 0; m < count; m++)
+                sum += scales[m * scale_stride + k * scale_step] * x[(size_t)m * stride + i];
+            dest[k * stride + i] = sum;
+        }
+    }
+}
+
+__attribute__((target("avx512f"))) void kernel_gather_axpy_avx512(real *y, const real *rows, int n,
+                                                                  const int32_t *indices, const real *x, int count)
+{
+    int j = 0;
+    for (; j + LANES_512 <= n; j += LANES_512)
+    {
+        // Several sums hide the latency of each multiply-add
+        VEC_512 s0 = LOAD_512(y + j), s1 = ZERO_512(), s2 = ZERO_512(), s3 = ZERO_512();
+        int i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            s0 = FMADD_512(SET1_512(x[i]), LOAD_512(rows + (size_t)indices[i] * n + j), s0);
+            s1 = FMADD_512(SET1_512(x[i + 1]), LOAD_512(rows + (size_t)indices[i + 1] * n + j), s1);
+            s2 = FMADD_512(SET1_512(x[i + 2]), LOAD_512(rows + (size_t)indices[i + 2] * n + j), s2);
+            s3 = FMADD_512(SET1_512(x[i + 3]), LOAD_512(rows + (size_t)indices[i + 3] * n + j), s3);
+        }
+        for (; i < count; i++)
+            s0 = FMADD_512(SET1_512(x[i]), LOAD_512(rows + (size_t)indices[i] * n + j), s0);
+
+        STORE_512(y + j, ADD_512(ADD_512(s0, s1), ADD_512(s2, s3)));
+    }
+    for (; j < n; j++)
+    {
+        for (int i = 0; i < count; i++)
+            y[j] += x[i] * rows[(size_t)indices[i] * n + j];
+    }
+}
+
+__attribute__((target("avx512f"))) void kernel_scatter_axpy_avx512(real *rows, int n, const int32_t *indices,
+                                                                   const real *x, int count, const real *v)
+{
+    for (int i = 0; i < count; i++)
+    {
+        real *row = rows + (size_t)indices[i] * n;
+        VEC_512 s = SET1_512(x[i]);
+        int j = 0;
+        for (; j + LANES_512 <= n; j += LANES_512)
+            STORE_512(row + j, FMADD_512(s, LOAD_512(v + j), LOAD_512(row + j)));
+        for (; j < n; j++)
+            row[j] += x[i] * v[j];
+    }
+}
+
+__attribute__((target("avx512f"))) void kernel_sigmoid_avx512(real *dest, const real *src, int n)
+{
+    const VEC_512 clamp = SET1_512(EXP_CLAMP), one = SET1_512(1);
+    int i = 0;
+    for (; i + LANES_512 <= n; i += LANES_512)
+    {
+        VEC_512 t = SUB_512(ZERO_512(), LOAD_512(src + i));
+        t = MIN_512(MAX_512(t, SUB_512(ZERO_512(), clamp)), clamp);
+
+        VEC_512 k = ROUND_512(MUL_512(t, SET1_512(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        VEC_512 r = FNMADD_512(k, SET1_512(EXP_LN2_HI), t);
+        r = FNMADD_512(k, SET1_512(EXP_LN2_LO), r);
+
+        VEC_512 p = SET1_512(EXP_COEFFS[EXP_DEGREE]);
+        for (int c = EXP_DEGREE - 1; c >= 0; c--)
+            p = FMADD_512(p, r, SET1_512(EXP_COEFFS[c]));
+
+        STORE_512(dest + i, DIV_512(one, ADD_512(one, SCALEF_512(p, k))));
+    }
+    kernel_sigmoid_scalar(dest + i, src + i, n - i);
+}
+
+static real (*kernel_dot_impl)(const real *, const real *, int) = kernel_dot_scalar;
+static void (*kernel_dot4_impl)(real *, const real *, int, const real *, int) = kernel_dot4_scalar;
+static void (*kernel_axpy_impl)(real *, real, const real *, int) = kernel_axpy_scalar;
+static void (*kernel_outer_axpy4_impl)(real *, real *, const real *, const real *, int, const real *,
+                                       int) = kernel_outer_axpy4_scalar;
+static void (*kernel_matrix_axpy4_impl)(real *, const real *, int, int, const real *, int, int,
+                                        int) = kernel_matrix_axpy4_scalar;
+static void (*kernel_gather_axpy_impl)(real *, const real *, int, const int32_t *, const real *,
+                                       int) = kernel_gather_axpy_scalar;
+static void (*kernel_scatter_axpy_impl)(real *, int, const int32_t *, const real *, int,
+                                        const real *) = kernel_scatter_axpy_scalar;
+static void (*kernel_sigmoid_impl)(real *, const real *, int) = kernel_sigmoid_scalar;
+static const char *kernel_impl_name = "scalar";
+
+/**
+ * @brief Point the kernels at the best versions supported by the CPU. Until this is called the scalar versions are
+ * used. It must be called before any other thread starts, as the kernels read the choice without synchronisation.
+ */
+void kernel_init()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        kernel_dot_impl = kernel_dot_avx512;
+        kernel_dot4_impl = kernel_dot4_avx512;
+        kernel_axpy_impl = kernel_axpy_avx512;
+        kernel_outer_axpy4_impl = kernel_outer_axpy4_avx512;
+        kernel_matrix_axpy4_impl = kernel_matrix_axpy4_avx512;
+        kernel_gather_axpy_impl = kernel_gather_axpy_avx512;
+        kernel_scatter_axpy_impl = kernel_scatter_axpy_avx512;
+        kernel_sigmoid_impl = kernel_sigmoid_avx512;
+        kernel_impl_name = "avx512";
+    }
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        kernel_dot_impl = kernel_dot_avx2;
+        kernel_dot4_impl = kernel_dot4_avx2;
+        kernel_axpy_impl = kernel_axpy_avx2;
+        kernel_outer_axpy4_impl = kernel_outer_axpy4_avx2;
+        kernel_matrix_axpy4_impl = kernel_matrix_axpy4_avx2;
+        kernel_gather_axpy_impl = kernel_gather_axpy_avx2;
+        kernel_scatter_axpy_impl = kernel_scatter_axpy_avx2;
+        kernel_sigmoid_impl = kernel_sigmoid_avx2;
+        kernel_impl_name = "avx2";
+    }
+    else
+    {
+        kernel_dot_impl = kernel_dot_scalar;
+        kernel_dot4_impl = kernel_dot4_scalar;
+        kernel_axpy_impl = kernel_axpy_scalar;
+        kernel_outer_axpy4_impl = kernel_outer_axpy4_scalar;
+        kernel_matrix_axpy4_impl = kernel_matrix_axpy4_scalar;
+        kernel_gather_axpy_impl = kernel_gather_axpy_scalar;
+        kernel_scatter_axpy_impl = kernel_scatter_axpy_scalar;
+        kernel_sigmoid_impl = kernel_sigmoid_scalar;
+        kernel_impl_name = "scalar";
+    }
+}
+
+/**
+ * @brief Calculate the dot product of two arrays.
+ *
+ * @param a first array.
+ * @param b second array.
+ * @param n number of values in each array.
+ * @return dot product.
+ */
+real kernel_dot(const real *a, const real *b, int n)
+{
+    return kernel_dot_impl(a, b, n);
+}
+
+/**
+ * @brief Calculate the dot products of four consecutive rows with one array, loading the array once for all four.
+ *
+ * @param dest place to store the four dot products.
+ * @param a first row.
+ * @param stride distance between the start of each row.
+ * @param b array to multiply each row by.
+ * @param n number of values in each row.
+ */
+void kernel_dot4(real *dest, const real *a, int stride, const real *b, int n)
+{
+    kernel_dot4_impl(dest, a, stride, b, n);
+}
+
+/**
+ * @brief Add a scaled array to another array (y += scale * x).
+ *
+ * @param y array to add to.
+ * @param scale value to multiply x by.
+ * @param x array to scale and add.
+ * @param n number of values in each array.
+ */
+void kernel_axpy(real *y, real scale, const real *x, int n)
+{
+    kernel_axpy_impl(y, scale, x, n);
+}
+
+/**
+ * @brief Add an array scaled by four values to four rows of a matrix (dest_k += scales_k * x), and add four rows of
+ * another matrix scaled by the same values to an array (y += scales_k * rows_k, in order of k). Both updates are made
+ * in one pass, and y is read and written once for the four rows rather than once per row.
+ *
+ * @param dest first of the four rows to add to.
+ * @param y array to add to. It must not overlap the other arrays.
+ * @param x array to scale and add to each row of dest.
+ * @param rows first of the four rows to scale and add to y.
+ * @param stride distance between consecutive rows of dest and of rows.
+ * @param scales four values to multiply by.
+ * @param n number of values in x, y and each row.
+ */
+void kernel_outer_axpy4(real *dest, real *y, const real *x, const real *rows, int stride, const real *scales, int n)
+{
+    kernel_outer_axpy4_impl(dest, y, x, rows, stride, scales, n);
+}
+
+/**
+ * @brief Add rows of a matrix, each scaled by four values, to four rows of another matrix (dest_k += scales_mk * x_m
+ * summed over m, in order of m). This is a block of four rows of a matrix product. The sums for a few vectors of the
+ * four rows are kept in registers over all the rows of x, so each value of dest is loaded and stored once however many
+ * rows are added to it.
+ *
+ * @param dest first of the four rows to add to. It must not overlap x.
+ * @param x first row to scale and add.
+ * @param stride distance between consecutive rows of dest and of x.
+ * @param count number of rows of x.
+ * @param scales values to multiply by, with scales_mk at scales[m * scale_stride + k * scale_step].
+ * @param scale_stride distance between the values for consecutive rows of x.
+ * @param scale_step distance between the values for consecutive rows of dest.
+ * @param n number of values in each row.
+ */
+void kernel_matrix_axpy4(real *dest, const real *x, int stride, int count, const real *scales, int scale_stride,
+                         int scale_step, int n)
+{
+    kernel_matrix_axpy4_impl(dest, x, stride, count, scales, scale_stride, scale_step, n);
+}
+
+/**
+ * @brief Add scaled rows of a matrix, picked by index, to an array (y += sum of x_i * rows[indices_i]). This multiplies
+ * a sparse array by a matrix stored transposed, touching only the rows for its nonzero values.
+ *
+ * @param y array to add to.
+ * @param rows matrix to pick rows from.
+ * @param n number of values in y and in each row.
+ * @param indices index of each row to add.
+ * @param x value to multiply each row by.
+ * @param count number of rows to add.
+ */
+void kernel_gather_axpy(real *y, const real *rows, int n, const int32_t *indices, const real *x, int count)
+{
+    kernel_gather_axpy_impl(y, rows, n, indices, x, count);
+}
+
+/**
+ * @brief Add a scaled array to rows of a matrix picked by index (rows[indices_i] += x_i * v). This adds the outer
+ * product of a sparse array and a dense array to a matrix, touching only the rows for the nonzero values.
+ *
+ * @param rows matrix to add to.
+ * @param n number of values in v and in each row.
+ * @param indices index of each row to add to, with no index repeated.
+ * @param x value to multiply v by for each row.
+ * @param count number of rows to add to.
+ * @param v array to scale and add.
+ */
+void kernel_scatter_axpy(real *rows, int n, const int32_t *indices, const real *x, int count, const real *v)
+{
+    kernel_scatter_axpy_impl(rows, n, indices, x, count, v);
+}
+
+/**
+ * @brief Apply the sigmoid function to each value of an array, using an approximation of exp that vectorizes.
+ *
+ * @param dest array to store the results in, which may be the same as src.
+ * @param src array of values to apply the sigmoid function to.
+ * @param n number of values in each array.
+ */
+void kernel_sigmoid(real *dest, const real *src, int n)
+{
+    kernel_sigmoid_impl(dest, src, n);
+}
+
+/**
+ * @brief Get the name of the versions of the kernels in use.
+ *
+ * @return name of the versions.
+ */
+const char *kernel_name()
+{
+    return kernel_impl_name;
+}
\ No newline at end of file
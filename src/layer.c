@@ -0,0 +1,108 @@
+#include <layer.h>
+#include <kernel.h>
+#include <string.h>
+
+/*
+A layer is run in one sweep over its outputs: each row of raw node values is finished with the biases as it is
+computed, and the activation function is applied to the row while it is still in cache, rather than making separate
+passes for the product, the biases, a copy and the activation. Only the cost of a softmax output needs raw node values
+once the node values are known, so every other layer computes them in place.
+*/
+
+/**
+ * @brief Apply the activation function of a layer to consecutive rows of its raw node values. The sigmoid function is
+ * applied to all the rows at once so that narrow layers still fill whole vectors.
+ *
+ * @param dest place to store the node values of the first row, which may be the same as raw.
+ * @param raw raw node values of the first row.
+ * @param rows number of rows.
+ * @param width number of nodes in the layer.
+ * @param softmax whether to apply softmax to each row rather than the sigmoid function to each value.
+ */
+void layer_activate_rows(real *dest, const real *raw, int rows, int width, int softmax)
+{
+    if (!softmax)
+    {
+        kernel_sigmoid(dest, raw, rows * width);
+        return;
+    }
+
+    if (dest != raw)
+        memcpy(dest, raw, sizeof(real) * rows * width);
+    for (int r = 0; r < rows; r++)
+    {
+        Vector row = {width, dest + r * width};
+        vector_softmax(&row);
+    }
+}
+
+/**
+ * @brief Run a layer on a batch of inputs, computing the raw node values and node values in a single sweep.
+ *
+ * @param raw place to store the raw node values, one row per input, or 0 if they are not needed.
+ * @param dest place to store the node values, one row per input.
+ * @param input node values of the previous layer, one row per input.
+ * @param weights weights of the layer.
+ * @param biases biases of the layer.
+ * @param softmax whether to apply softmax to each row rather than the sigmoid function to each value.
+ */
+void layer_forward(Matrix *raw, Matrix *dest, Matrix *input, Matrix *weights, Vector *biases, int softmax)
+{
+    const int BLOCK = 4;
+    const int k_size = input->width;
+    const int width = dest->width;
+    real *out = raw ? raw->values : dest->values;
+
+    int n = 0;
+    // Compute BLOCK rows at once so each row of weights is loaded once per block
+    for (; n + BLOCK <= input->height; n += BLOCK)
+    {
+        for (int m = 0; m < weights->height; m++)
+        {
+            real sums[4];
+            kernel_dot4(sums, input->values + n * k_size, k_size, weights->values + m * k_size, k_size);
+            for (int r = 0; r < BLOCK; r++)
+                out[(n + r) * width + m] = sums[r] + biases->values[m];
+        }
+        layer_activate_rows(dest->values + n * width, out + n * width, BLOCK, width, softmax);
+    }
+
+    // Remaining rows
+    for (; n < input->height; n++)
+    {
+        for (int m = 0; m < weights->height; m++)
+        {
+            real sum = kernel_dot(weights->values + m * k_size, input->values + n * k_size, k_size);
+            out[n * width + m] = sum + biases->values[m];
+        }
+        layer_activate_rows(dest->values + n * width, out + n * width, 1, width, softmax);
+    }
+}
+
+/**
+ * @brief Run a layer on a batch of sparse inputs, computing the raw node values and node values in a single sweep.
+ * Each row of raw node values starts as the biases and has a row of the transposed weights added for each nonzero
+ * input.
+ *
+ * @param raw place to store the raw node values, one row per input, or 0 if they are not needed.
+ * @param dest place to store the node values, one row per input.
+ * @param input sparse input for each row.
+ * @param transposed transposed weights of the layer, with a row for each input.
+ * @param biases biases of the layer.
+ * @param softmax whether to apply softmax to each row rather than the sigmoid function to each value.
+ */
+void layer_forward_sparse(Matrix *raw, Matrix *dest, Sparse_Vector *input, Matrix *transposed, Vector *biases,
+                          int softmax)
+{
+    const int width = dest->width;
+    real *out = raw ? raw->values : dest->values;
+
+    for (int n = 0; n < dest->height; n++)
+    {
+        real *row = out + n * width;
+        memcpy(row, biases->values, sizeof(real) * width);
+        kernel_gather_axpy(row, transposed->values, transposed->width, input[n].indices, input[n].values,
+                           input[n].count);
+        layer_activate_rows(dest->values + n * width, row, 1, width, softmax);
+    }
+}
\ No newline at end of file
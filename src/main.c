@@ -1,33 +1,374 @@
 #include <image.h>
 #include <neural_net.h>
+#include <evaluate.h>
+#include <server.h>
+#include <bench.h>
+#include <profile.h>
+#include <kernel.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <stdio.h>
+#include <unistd.h>
 
-int main(int argc, char *argv[])
+/**
+ * @brief Print how to use the program.
+ */
+void print_usage()
 {
-    srand(time(NULL));
+    printf("usage: num-identifier train [-p] [-s] [-d] [-t threads] [-o sgd|momentum|nesterov|adam] [-l step-size]\n");
+    printf("                            [-e epochs] [-a sigmoid|softmax] [-b shuffle-buffer] [-r seed]\n");
+    printf("                            <images> <labels> [model]\n");
+    printf("       num-identifier test <model> <images> <labels>\n");
+    printf("       num-identifier serve [-b max-batch] [-w max-wait-us] <model> [socket]\n");
+    printf("       num-identifier classify <socket> <images> <labels>\n");
+    printf("       num-identifier bench [images labels]\n");
+}
 
-    if (argc < 2)
+/**
+ * @brief Train a new network on a dataset, optionally saving it to a model file. With -p, the time spent in each phase
+ * of training is included in the statistics printed for each iteration. With -s, the nonzero pixels of each image are
+ * found when the dataset is loaded so that the first layer can skip the rest. -t sets the number of threads to train
+ * with, which defaults to the number of processors. With -d, each thread trains on a fixed slice of every segment so
+ * that runs with the same seed and thread count give identical networks. The result depends on the thread count, so -t
+ * must be given with the same value to repeat a -d run on a machine with a different number of processors. -o, -l and
+ * -e choose the optimizer, its step size and the number of iterations. -a chooses the output layer, which is saved with
+ * the model. With -b, the files are streamed through a shuffle buffer of the given number of images rather than loaded,
+ * so files larger than memory can be trained on. -r seeds the initial weights and the shuffling so a run can be
+ * repeated, otherwise the seed comes from the time.
+ *
+ * @param argc number of arguments including the command.
+ * @param argv arguments including the command.
+ * @return exit code.
+ */
+int train(int argc, char *argv[])
+{
+    Profile profile;
+    profile_reset(&profile);
+    Profile *active_profile = 0;
+    int sparse = 0;
+    Train_Options options = train_options_default();
+    options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    Output_Type output = OUTPUT_SIGMOID;
+    int stream_buffer = 0;
+    uint64_t seed = time(NULL);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "psdt:o:l:e:a:b:r:")) != -1)
     {
-        printf("usage: num-identifier <train | test> <images> <labels>\n");
+        switch (opt)
+        {
+        case 'p':
+            active_profile = &profile;
+            break;
+        case 's':
+            sparse = 1;
+            break;
+        case 'd':
+            options.deterministic = 1;
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            if (options.threads < 1)
+            {
+                print_usage();
+                return 1;
+            }
+            break;
+        case 'o':
+            if (optimizer_parse_type(optarg, &options.optimizer) != 0)
+            {
+                print_usage();
+                return 1;
+            }
+            break;
+        case 'l':
+            options.step_size = atof(optarg);
+            break;
+        case 'e':
+            options.iterations = atoi(optarg);
+            break;
+        case 'a':
+            if (network_parse_output(optarg, &output) != 0)
+            {
+                print_usage();
+                return 1;
+            }
+            break;
+        case 'b':
+            stream_buffer = atoi(optarg);
+            if (stream_buffer <= 0)
+            {
+                print_usage();
+                return 1;
+            }
+            break;
+        case 'r':
+            seed = strtoull(optarg, 0, 10);
+            break;
+        default:
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2 || options.step_size <= 0 || options.iterations <= 0)
+    {
+        print_usage();
         return 1;
     }
+    argv += optind;
+    argc -= optind;
 
-    Dataset *dataset = image_load(argv[1], argv[2]);
+    Dataset *dataset = 0;
+    Image_Stream *stream = 0;
+    int image_size;
+    if (stream_buffer)
+    {
+        stream = stream_open(argv[0], argv[1], stream_buffer);
+        if (!stream)
+        {
+            printf("failed to open dataset stream from %s and %s\n", argv[0], argv[1]);
+            return 1;
+        }
+        stream->sparse = sparse;
+        image_size = stream->size;
+    }
+    else
+    {
+        uint64_t start = profile_start(active_profile);
+        dataset = image_load(argv[0], argv[1]);
+        if (!dataset)
+        {
+            printf("failed to load dataset from %s and %s\n", argv[0], argv[1]);
+            return 1;
+        }
+        if (sparse && dataset_sparsify(dataset) != 0)
+        {
+            printf("failed to sparsify dataset\n");
+            dataset_free_p(dataset);
+            return 1;
+        }
+        profile_stop(active_profile, PROFILE_LOAD, start);
+        if (active_profile)
+            printf("{\"load\":\"%s\",\"images\":%i,\"seconds\":%.6f}\n", argv[0], dataset->count,
+                   profile.ns[PROFILE_LOAD] * 1e-9);
+        image_size = dataset->images[0].size;
+    }
 
     Neural_Net *network;
-    int arr[4] = {dataset->images[0].size, 16, 16, 10};
+    int arr[4] = {image_size, 16, 16, 10};
     network = malloc(sizeof(Neural_Net));
     *network = network_malloc(4, (int *)&arr);
+    network->output = output;
 
-    network_initialize(network, 1);
+    if (stream)
+        stream->classes = arr[3];
+    else if (dataset_check_labels(dataset, arr[3]) != 0)
+    {
+        printf("dataset has labels that are not below %i\n", arr[3]);
+        dataset_free_p(dataset);
+        network_free_p(network);
+        return 1;
+    }
+
+    // Shuffling continues the sequence used for the weights so the two never overlap
+    Rng rng = rnd_create(seed);
+    network_initialize(network, &rng, 1);
+    options.seed = rnd_next(&rng);
+
+    options.profile = active_profile;
+    int res = 0;
+    if ((stream ? network_train_stream(network, stream, &options) : network_train(network, dataset, &options)) != 0)
+    {
+        printf("failed to train on %s and %s\n", argv[0], argv[1]);
+        res = 1;
+    }
+
+    if (res == 0 && argc > 2 && network_save(network, argv[2]) != 0)
+    {
+        printf("failed to save model to %s\n", argv[2]);
+        res = 1;
+    }
+
+    // Free values
+    if (stream)
+        stream_close(stream);
+    else
+        dataset_free_p(dataset);
+    network_free_p(network);
+
+    return res;
+}
+
+/**
+ * @brief Evaluate a saved network on a dataset.
+ *
+ * @param argc number of arguments after the command.
+ * @param argv arguments after the command.
+ * @return exit code.
+ */
+int test(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        print_usage();
+        return 1;
+    }
+
+    Neural_Net *network = network_load(argv[0]);
+    if (!network)
+    {
+        printf("failed to load model from %s\n", argv[0]);
+        return 1;
+    }
+
+    Dataset *dataset = image_load(argv[1], argv[2]);
+    if (!dataset)
+    {
+        printf("failed to load dataset from %s and %s\n", argv[1], argv[2]);
+        network_free_p(network);
+        return 1;
+    }
+
+    if (dataset->images[0].size != network->weights[0].width)
+    {
+        printf("model expects images of %i pixels but dataset has %i\n", network->weights[0].width,
+               dataset->images[0].size);
+        dataset_free_p(dataset);
+        network_free_p(network);
+        return 1;
+    }
+
+    const int classes = network->biases[network->layers - 1].size;
+    if (dataset_check_labels(dataset, classes) != 0)
+    {
+        printf("dataset has labels that are not below the model's %i outputs\n", classes);
+        dataset_free_p(dataset);
+        network_free_p(network);
+        return 1;
+    }
 
-    network_train(network, dataset, 5, 20, 0.1);
+    Evaluation evaluation = network_evaluate(network, dataset, sysconf(_SC_NPROCESSORS_ONLN));
+    evaluation_print(&evaluation);
 
     // Free values
+    evaluation_free(evaluation);
     dataset_free_p(dataset);
     network_free_p(network);
 
     return 0;
 }
+
+/**
+ * @brief Serve predictions from a saved network, over a Unix socket if one is given or otherwise from stdin to stdout.
+ *
+ * @param argc number of arguments including the command.
+ * @param argv arguments including the command.
+ * @return exit code.
+ */
+int serve(int argc, char *argv[])
+{
+    Server_Options options = server_options_default();
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            options.max_batch = atoi(optarg);
+            break;
+        case 'w':
+            options.max_wait_us = atoi(optarg);
+            break;
+        default:
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (optind >= argc || options.max_batch <= 0 || options.max_wait_us < 0)
+    {
+        print_usage();
+        return 1;
+    }
+
+    Neural_Net *network = network_load(argv[optind]);
+    if (!network)
+    {
+        fprintf(stderr, "failed to load model from %s\n", argv[optind]);
+        return 1;
+    }
+
+    int res;
+    if (optind + 1 < argc)
+    {
+        res = server_run_socket(network, argv[optind + 1], &options);
+        if (res != 0)
+            fprintf(stderr, "failed to listen on %s\n", argv[optind + 1]);
+    }
+    else
+    {
+        res = server_run_stream(network, STDIN_FILENO, STDOUT_FILENO, &options);
+    }
+
+    network_free_p(network);
+
+    return res;
+}
+
+/**
+ * @brief Send a dataset to a server and report how well it was classified.
+ *
+ * @param argc number of arguments after the command.
+ * @param argv arguments after the command.
+ * @return exit code.
+ */
+int classify(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        print_usage();
+        return 1;
+    }
+
+    Dataset *dataset = image_load(argv[1], argv[2]);
+    if (!dataset)
+    {
+        printf("failed to load dataset from %s and %s\n", argv[1], argv[2]);
+        return 1;
+    }
+
+    int res = client_run(argv[0], dataset);
+
+    dataset_free_p(dataset);
+
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    // Pick the kernels before any threads start
+    kernel_init();
+
+    if (argc < 2)
+    {
+        print_usage();
+        return 1;
+    }
+
+    if (strcmp(argv[1], "train") == 0)
+        return train(argc - 1, argv + 1);
+    if (strcmp(argv[1], "test") == 0)
+        return test(argc - 2, argv + 2);
+    if (strcmp(argv[1], "serve") == 0)
+        return serve(argc - 1, argv + 1);
+    if (strcmp(argv[1], "classify") == 0)
+        return classify(argc - 2, argv + 2);
+    if (strcmp(argv[1], "bench") == 0)
+        return bench_run(argc > 3 ? argv[2] : 0, argc > 3 ? argv[3] : 0, sysconf(_SC_NPROCESSORS_ONLN));
+
+    print_usage();
+    return 1;
+}
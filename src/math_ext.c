@@ -1,4 +1,5 @@
 #include <math.h>
+#include <math_ext.h>
 
 /**
  * @brief Apply sigmoid function to a value.
@@ -6,9 +7,23 @@
  * @param x value to apply function to.
  * @return result of function.
  */
-double sigmoid(double x)
+real sigmoid(real x)
 {
-    double e = exp(-x);
+    real e = REAL_EXP(-x);
 
     return 1 / (1 + e);
+}
+
+/**
+ * @brief Compare two doubles for sorting.
+ *
+ * @param a first double.
+ * @param b second double.
+ * @return negative, zero or positive if a is less than, equal to or greater than b.
+ */
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
 }
\ No newline at end of file
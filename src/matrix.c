@@ -17,6 +17,8 @@ Matrix matrix_error()
     err.width = -1;
     err.height = -1;
     err.values = 0;
+
+    return err;
 }
 
 /**
@@ -37,7 +39,36 @@ Matrix matrix_malloc(int width, int height)
 
     new.width = width;
     new.height = height;
-    new.values = malloc(sizeof(double) * width * height);
+    new.values = malloc(sizeof(real) * width * height);
+
+    return new;
+}
+
+/**
+ * @brief Allocates memory for a new matrix with the values starting on a boundary, so that they can be loaded with
+ * aligned vector instructions and rows never share a cache line with other data.
+ *
+ * @param width width of the matrix.
+ * @param height height of the matrix.
+ * @param alignment boundary in bytes to align the values to, which must be a power of two.
+ * @return a new matrix with memory allocated for the values. It is freed with matrix_free as normal.
+ */
+Matrix matrix_malloc_aligned(int width, int height, int alignment)
+{
+    if (width <= 0 || height <= 0)
+    {
+        return matrix_error();
+    }
+
+    // aligned_alloc needs the size to be a multiple of the alignment
+    size_t size = sizeof(real) * width * height;
+    size = (size + alignment - 1) / alignment * alignment;
+
+    Matrix new;
+
+    new.width = width;
+    new.height = height;
+    new.values = aligned_alloc(alignment, size);
 
     return new;
 }
@@ -122,10 +153,54 @@ char *matrix_to_string(const Matrix m)
  * @brief Initialize a matrix with random values sampled from a normal distribution;
  *
  * @param m matrix to initialize.
+ * @param rng random number generator to sample with.
  * @param std_dev standard deviation of normal distribution to sample.
  */
-void matrix_fill_normal(Matrix *m, double std_dev)
+void matrix_fill_normal(Matrix *m, Rng *rng, double std_dev)
+{
+    rnd_fill_normal(rng, m->values, m->width * m->height, std_dev);
+}
+
+/**
+ * @brief Transpose a matrix (dest = src^T).
+ *
+ * @param dest matrix to store result in, with a height of the width of src and width of the height of src.
+ * @param src matrix to transpose.
+ * @return matrix result.
+ */
+Matrix *matrix_transpose(Matrix *dest, Matrix *src)
 {
-    for (int i = 0; i < m->width * m->height; i++)
-        m->values[i] = rnd_normal(std_dev);
+    if (dest->width != src->height || dest->height != src->width)
+    {
+        *dest = matrix_error();
+        return dest;
+    }
+
+    for (int i = 0; i < src->height; i++)
+        for (int j = 0; j < src->width; j++)
+            dest->values[j * dest->width + i] = src->values[i * src->width + j];
+
+    return dest;
 }
+
+/**
+ * @brief Add the transpose of a matrix to a matrix (dest += src^T).
+ *
+ * @param dest matrix to add to, with a height of the width of src and width of the height of src.
+ * @param src matrix to transpose and add.
+ * @return matrix result.
+ */
+Matrix *matrix_add_transposed(Matrix *dest, Matrix *src)
+{
+    if (dest->width != src->height || dest->height != src->width)
+    {
+        *dest = matrix_error();
+        return dest;
+    }
+
+    for (int i = 0; i < dest->height; i++)
+        for (int j = 0; j < dest->width; j++)
+            dest->values[i * dest->width + j] += src->values[j * src->width + i];
+
+    return dest;
+}
\ No newline at end of file
@@ -1,7 +1,46 @@
 #include <neural_net.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <backpropagation.h>
+#include <prefetch.h>
+#include <layer.h>
+#include <math_ext.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <limits.h>
+
+#define MODEL_MAGIC "NNET"
+#define MODEL_VERSION 2
+#define MODEL_ALIGNMENT 64
+#define MODEL_MAX_LAYERS 1024
+
+/*
+Model file layout:
+    Model_Header
+    uint32_t neurons_per_layer[header.layers]
+    padding up to a multiple of MODEL_ALIGNMENT
+    real values[total_values], laid out the same as Neural_Net.values
+All values are stored in the byte order of the machine that wrote the file. Version 1 files have no output field in
+the header and always use a sigmoid output.
+*/
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t value_size;
+    uint32_t layers;
+    uint32_t output;
+} Model_Header;
+
+#define MODEL_V1_HEADER_SIZE offsetof(Model_Header, output)
+
+static const char *OUTPUT_NAMES[] = {"sigmoid", "softmax"};
 
 /**
  * @brief Creates a network that represents an error.
@@ -13,42 +52,91 @@ Neural_Net network_error()
     Neural_Net error;
     error.layers = -1;
     error.total_values = -1;
+    error.output = OUTPUT_SIGMOID;
+    error.values = 0;
     error.weights = 0;
     error.biases = 0;
+    error.map = 0;
+    error.map_size = 0;
 
     return error;
 }
 
 /**
- * @brief Allocates memory for a new network.
+ * @brief Count the number of weights and biases in a network.
  *
  * @param layers number of layers in the network.
  * @param neurons_per_layer an array with the number of neurons that are in each layer.
- * @return a new network with memory allocated for the weights and biases.
+ * @return number of values.
  */
-Neural_Net network_malloc(int layers, int *neurons_per_layer)
+int network_count_values(int layers, int *neurons_per_layer)
 {
-    if (layers <= 0)
-        return network_error();
+    int total_values = 0;
+    for (int i = 0; i < layers - 1; i++)
+        total_values += (neurons_per_layer[i] + 1) * neurons_per_layer[i + 1];
 
+    return total_values;
+}
+
+/**
+ * @brief Create a network whose weight matrices and bias vectors refer to an existing buffer of values.
+ *
+ * @param layers number of layers in the network.
+ * @param neurons_per_layer an array with the number of neurons that are in each layer.
+ * @param values buffer holding all the weights and biases.
+ * @return a new network referring to the values.
+ */
+Neural_Net network_view(int layers, int *neurons_per_layer, real *values)
+{
     Neural_Net new;
     new.layers = layers - 1;
-    new.total_values = 0;
+    new.total_values = network_count_values(layers, neurons_per_layer);
+    new.output = OUTPUT_SIGMOID;
+    new.values = values;
     new.weights = malloc(sizeof(Matrix) * (layers - 1));
     new.biases = malloc(sizeof(Vector) * (layers - 1));
+    new.map = 0;
+    new.map_size = 0;
 
-    // Create weight matrices and bias vectors
+    // Create weight matrices and bias vectors referring to the values
+    int index = 0;
     for (int i = 0; i < layers - 1; i++)
     {
-        new.weights[i] = matrix_malloc(neurons_per_layer[i], neurons_per_layer[i + 1]);
-        new.total_values += neurons_per_layer[i] * neurons_per_layer[i + 1];
-        new.biases[i] = vector_malloc(neurons_per_layer[i + 1]);
-        new.total_values += neurons_per_layer[i + 1];
+        new.weights[i].width = neurons_per_layer[i];
+        new.weights[i].height = neurons_per_layer[i + 1];
+        new.weights[i].values = new.values + index;
+        index += neurons_per_layer[i] * neurons_per_layer[i + 1];
+
+        new.biases[i].size = neurons_per_layer[i + 1];
+        new.biases[i].values = new.values + index;
+        index += neurons_per_layer[i + 1];
     }
 
     return new;
 }
 
+/**
+ * @brief Allocates memory for a new network.
+ *
+ * All of the weights and biases are stored in a single aligned buffer, in the order weights then biases for each layer
+ * from the start of the network to the end. The weight matrices and bias vectors refer to parts of that buffer.
+ *
+ * @param layers number of layers in the network.
+ * @param neurons_per_layer an array with the number of neurons that are in each layer.
+ * @return a new network with memory allocated for the weights and biases.
+ */
+Neural_Net network_malloc(int layers, int *neurons_per_layer)
+{
+    if (layers <= 1)
+        return network_error();
+
+    void *values;
+    if (posix_memalign(&values, MODEL_ALIGNMENT, sizeof(real) * network_count_values(layers, neurons_per_layer)) != 0)
+        return network_error();
+
+    return network_view(layers, neurons_per_layer, values);
+}
+
 /**
  * @brief Frees memory used by a network.
  *
@@ -56,11 +144,10 @@ Neural_Net network_malloc(int layers, int *neurons_per_layer)
  */
 void network_free(Neural_Net n)
 {
-    for (int i = 0; i < n.layers; i++)
-    {
-        matrix_free(n.weights[i]);
-        vector_free(n.biases[i]);
-    }
+    if (n.map)
+        munmap(n.map, n.map_size);
+    else
+        free(n.values);
     free(n.weights);
     free(n.biases);
 }
@@ -76,52 +163,328 @@ void network_free_p(Neural_Net *n)
     free(n);
 }
 
+/**
+ * @brief Calculate the size of the header of a model file.
+ *
+ * @param version version of the model file.
+ * @return size of the header.
+ */
+size_t network_model_header_size(uint32_t version)
+{
+    return version == 1 ? MODEL_V1_HEADER_SIZE : sizeof(Model_Header);
+}
+
+/**
+ * @brief Calculate where the values start in a model file.
+ *
+ * @param layers number of layers in the model.
+ * @param version version of the model file.
+ * @return offset of the values from the start of the file.
+ */
+size_t network_model_values_offset(uint32_t layers, uint32_t version)
+{
+    size_t offset = network_model_header_size(version) + sizeof(uint32_t) * layers;
+
+    return (offset + MODEL_ALIGNMENT - 1) / MODEL_ALIGNMENT * MODEL_ALIGNMENT;
+}
+
+/**
+ * @brief Count the values stored in a model file, checking that every layer has nodes and that the count fits in the
+ * int used for the size of a network.
+ *
+ * @param layers number of layers in the model, at most MODEL_MAX_LAYERS.
+ * @param stored_neurons number of neurons in each layer, as stored in the file.
+ * @return number of values, or -1 if a layer is empty or the count is too large.
+ */
+int network_model_count_values(uint32_t layers, const uint32_t *stored_neurons)
+{
+    size_t total_values = 0;
+    for (uint32_t i = 0; i < layers; i++)
+    {
+        if (stored_neurons[i] == 0 || stored_neurons[i] > INT_MAX)
+            return -1;
+    }
+
+    for (uint32_t i = 0; i + 1 < layers; i++)
+    {
+        // Both widths are at most INT_MAX, so the product cannot overflow a 64 bit size_t
+        const size_t layer_values = ((size_t)stored_neurons[i] + 1) * stored_neurons[i + 1];
+        if (layer_values > INT_MAX - total_values)
+            return -1;
+        total_values += layer_values;
+    }
+
+    return total_values;
+}
+
+/**
+ * @brief Save a network to a model file.
+ *
+ * @param network network to save.
+ * @param file file to save the network to.
+ * @return 0 if the network was saved, otherwise -1.
+ */
+int network_save(Neural_Net *network, const char *file)
+{
+    FILE *f = fopen(file, "wb");
+    if (!f)
+        return -1;
+
+    Model_Header header;
+    memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+    header.version = MODEL_VERSION;
+    header.value_size = sizeof(real);
+    header.layers = network->layers + 1;
+    header.output = network->output;
+
+    uint32_t *neurons_per_layer = malloc(sizeof(uint32_t) * header.layers);
+    neurons_per_layer[0] = network->weights[0].width;
+    for (int i = 0; i < network->layers; i++)
+        neurons_per_layer[i + 1] = network->weights[i].height;
+
+    const char padding[MODEL_ALIGNMENT] = {0};
+    const size_t padding_size =
+        network_model_values_offset(header.layers, MODEL_VERSION) - sizeof(header) - sizeof(uint32_t) * header.layers;
+
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(neurons_per_layer, sizeof(uint32_t), header.layers, f) == header.layers;
+    ok = ok && fwrite(padding, 1, padding_size, f) == padding_size;
+    ok = ok && fwrite(network->values, sizeof(real), network->total_values, f) == (size_t)network->total_values;
+    ok = fclose(f) == 0 && ok;
+
+    free(neurons_per_layer);
+
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Load a network from a model file. The file is mapped into memory and the network refers to the values in the
+ * mapping directly. The mapping is private, so adjusting the network does not change the file.
+ *
+ * @param file file to load the network from.
+ * @return the loaded network, or 0 if the file is not a valid model.
+ */
+Neural_Net *network_load(const char *file)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)MODEL_V1_HEADER_SIZE)
+    {
+        close(fd);
+        return 0;
+    }
+
+    uint8_t *map = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    // Check header
+    Model_Header *header = (Model_Header *)map;
+    if (memcmp(header->magic, MODEL_MAGIC, sizeof(header->magic)) != 0 || header->version < 1 ||
+        header->version > MODEL_VERSION || header->value_size != sizeof(real) || header->layers < 2 ||
+        header->layers > MODEL_MAX_LAYERS || network_model_values_offset(header->layers, header->version) > (size_t)st.st_size)
+    {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    Output_Type output = header->version >= 2 ? header->output : OUTPUT_SIGMOID;
+    if (output != OUTPUT_SIGMOID && output != OUTPUT_SOFTMAX)
+    {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    // The layer sizes end before the values, which were checked to start within the file
+    const uint32_t *stored_neurons = (const uint32_t *)(map + network_model_header_size(header->version));
+    const int total_values = network_model_count_values(header->layers, stored_neurons);
+
+    // Check the values fill the rest of the file
+    const size_t offset = network_model_values_offset(header->layers, header->version);
+    if (total_values < 0 || (size_t)st.st_size - offset != sizeof(real) * total_values)
+    {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    int *neurons_per_layer = malloc(sizeof(int) * header->layers);
+    for (uint32_t i = 0; i < header->layers; i++)
+        neurons_per_layer[i] = stored_neurons[i];
+
+    Neural_Net *network = malloc(sizeof(Neural_Net));
+    *network = network_view(header->layers, neurons_per_layer, (real *)(map + offset));
+    network->output = output;
+    network->map = map;
+    network->map_size = st.st_size;
+
+    free(neurons_per_layer);
+
+    return network;
+}
+
+/**
+ * @brief Create a vector that refers to all the weights and biases of a network. The vector has the same layout as a
+ * gradient of the network. The vector shares memory with the network so must not be freed.
+ *
+ * @param network network to refer to.
+ * @return a vector referring to the values of the network.
+ */
+Vector network_view_values(Neural_Net *network)
+{
+    Vector view;
+    view.size = network->total_values;
+    view.values = network->values;
+
+    return view;
+}
+
+/**
+ * @brief Find the kind of output layer with a name.
+ *
+ * @param name name of the output layer, as returned by network_output_name.
+ * @param output place to store the kind of output layer.
+ * @return 0 if the name was found, otherwise -1.
+ */
+int network_parse_output(const char *name, Output_Type *output)
+{
+    for (int i = 0; i < (int)(sizeof(OUTPUT_NAMES) / sizeof(OUTPUT_NAMES[0])); i++)
+    {
+        if (strcmp(name, OUTPUT_NAMES[i]) == 0)
+        {
+            *output = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Get the name of a kind of output layer.
+ *
+ * @param output kind of output layer.
+ * @return name of the output layer.
+ */
+const char *network_output_name(Output_Type output)
+{
+    return OUTPUT_NAMES[output];
+}
+
 /**
  * @brief Initialize a network with random values sampled from a normal distribution;
  *
  * @param network network to initialize.
+ * @param rng random number generator to sample with. Each layer samples from its own generator split from it, so the
+ * layers could be filled in any order or in parallel and still get the same values.
  * @param std_dev standard deviation of normal distribution to sample.
  */
-void network_initialize(Neural_Net *network, double std_dev)
+void network_initialize(Neural_Net *network, Rng *rng, double std_dev)
 {
     for (int i = 0; i < network->layers; i++)
     {
-        matrix_fill_normal((network->weights) + i, std_dev);
-        vector_fill_normal((network->biases) + i, std_dev);
+        Rng layer_rng = rnd_split(rng);
+        matrix_fill_normal((network->weights) + i, &layer_rng, std_dev);
+        vector_fill_normal((network->biases) + i, &layer_rng, std_dev);
     }
 }
 
 /**
  * @brief Run the network in some input and store the values of all the nodes.
  *
- * @param raw_node_values place to store all raw node values (i.e. value before sigmoid is applied).
+ * @param raw_output place to store the raw node values of the last layer (i.e. values before the activation function
+ * is applied), or 0 if they are not needed.
  * @param node_values place to store all node values.
  * @param network network to run.
  * @param input input to the network.
+ * @param sparse sparse input to use in place of input, or 0 to use input.
+ * @param sparse_weights transposed weights of the first layer, used when the input is sparse.
  */
-void network_run(Vector *raw_node_values, Vector *node_values, Neural_Net *network, Vector *input)
+void network_run(Vector *raw_output, Vector *node_values, Neural_Net *network, Vector *input,
+                 Sparse_Vector *sparse, Matrix *sparse_weights)
 {
-    Vector *active_layer = input;
+    // Each vector is run as a batch of one row
+    Matrix active_layer = {input->size, 1, input->values};
 
     for (int i = 0; i < network->layers; i++)
     {
-        vector_matrix_mult(raw_node_values + i, active_layer, (network->weights) + i);
-        vector_add(raw_node_values + i, (network->biases) + i);
+        const int last = i == network->layers - 1;
+        Matrix raw_m, *raw = 0;
+        if (last && raw_output)
+        {
+            raw_m = (Matrix){raw_output->size, 1, raw_output->values};
+            raw = &raw_m;
+        }
+        Matrix node = {node_values[i].size, 1, node_values[i].values};
+        const int softmax = last && network->output == OUTPUT_SOFTMAX;
 
-        vector_copy(node_values + i, raw_node_values + i);
-        vector_sigmoid(node_values + i);
+        if (i == 0 && sparse)
+            layer_forward_sparse(raw, &node, sparse, sparse_weights, network->biases, softmax);
+        else
+            layer_forward(raw, &node, &active_layer, (network->weights) + i, (network->biases) + i, softmax);
 
-        active_layer = node_values + i;
+        active_layer = node;
     }
 
     // printf("%i : %s\n\n", input->size, vector_to_string(*input));
     // for (int i = 0; i < network->layers; i++)
     // {
-    //     printf("%i : %s\n\n", raw_node_values[i].size, vector_to_string(raw_node_values[i]));
     //     printf("%i : %s\n\n", node_values[i].size, vector_to_string(node_values[i]));
     // }
 }
 
+/**
+ * @brief Run the network on a batch of inputs and store the values of all the nodes.
+ *
+ * @param raw_output place to store the raw node values of the last layer, one row per input, or 0 if they are not
+ * needed.
+ * @param node_values place to store all node values, one row per input.
+ * @param network network to run.
+ * @param input inputs to the network, one row per input.
+ * @param sparse sparse input for each row to use in place of input, or 0 to use input.
+ * @param sparse_weights transposed weights of the first layer, used when the inputs are sparse.
+ */
+void network_run_batch(Matrix *raw_output, Matrix *node_values, Neural_Net *network, Matrix *input,
+                       Sparse_Vector *sparse, Matrix *sparse_weights)
+{
+    Matrix *active_layer = input;
+
+    for (int i = 0; i < network->layers; i++)
+    {
+        const int last = i == network->layers - 1;
+        Matrix *raw = last ? raw_output : 0;
+        const int softmax = last && network->output == OUTPUT_SOFTMAX;
+
+        if (i == 0 && sparse)
+            layer_forward_sparse(raw, node_values, sparse, sparse_weights, network->biases, softmax);
+        else
+            layer_forward(raw, node_values + i, active_layer, (network->weights) + i, (network->biases) + i, softmax);
+
+        active_layer = node_values + i;
+    }
+}
+
+/**
+ * @brief Calculate the cost of one output of a network. A sigmoid output uses the squared error and a softmax output
+ * uses the cross-entropy.
+ *
+ * @param network network the output came from.
+ * @param raw_output raw node values of the last layer. Only read for a softmax output.
+ * @param output node values of the last layer.
+ * @param expected expected result.
+ * @return cost of the output.
+ */
+double network_cost(Neural_Net *network, Vector *raw_output, Vector *output, Vector *expected)
+{
+    if (network->output == OUTPUT_SOFTMAX)
+        return vector_softmax_cross_entropy(raw_output, expected);
+
+    return vector_sq_diff_sum(expected, output);
+}
+
 /**
  * @brief Adjust all the values in a network by moving down the gradient.
  *
@@ -131,147 +494,892 @@ void network_run(Vector *raw_node_values, Vector *node_values, Neural_Net *netwo
  */
 void network_adjust(Neural_Net *network, Vector *gradient, double step_size)
 {
-    int index = 0;
-    for (int i = network->layers - 1; i >= 0; i--)
-    {
-        for (int j = 0; j < network->weights[i].width * network->weights[i].height; j++)
-            network->weights[i].values[j] -= gradient->values[index + j] * step_size;
+    Vector values = network_view_values(network);
+    vector_axpy(&values, -step_size, gradient);
+}
+
+/**
+ * @brief State for a single worker thread of an optimization step.
+ */
+typedef struct
+{
+    Neural_Net *network;
+    Dataset *dataset;
+    Matrix *inputs;
+    int batched;
+    int chunk_size;
+    int end;
+    atomic_int *next_image;
+    pthread_barrier_t *barrier;
+    Vector *partial_gradients;
+    int index;
+    int count;
+    double cost;
+    int correct_guesses;
+    Profile *profile;
+    Matrix *sparse_weights;
+    Optimize_Pool *pool;
+} Optimize_Worker;
+
+/**
+ * @brief Worker threads and the buffers they add their gradients to, kept for a whole training run so that each
+ * optimization step only has to wake the threads rather than create them and allocate new partial gradients.
+ */
+struct Optimize_Pool
+{
+    int threads;
+    int started;
+    Optimize_Worker *workers;
+    Vector *partial_gradients;
+    pthread_t *handles;
+    pthread_barrier_t barrier;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int step;
+    int stopping;
+    atomic_int next_image;
+    atomic_int *slice_positions;
+    Profile *profiles;
+    Matrix sparse_weights;
+};
 
-        index += network->weights[i].width * network->weights[i].height;
+/**
+ * @brief Claim the next chunk of images from the dataset being optimized. Normally all workers share one position in
+ * the dataset and chunks go to whichever worker asks first. In deterministic mode each worker has its own position in
+ * a fixed slice of the dataset, so every image is added to the same partial gradient in the same order on every run.
+ * The slices, and so the rounding of the sums, depend on the number of threads, so runs only match when that is the
+ * same too.
+ *
+ * @param worker worker claiming the chunk.
+ * @param offset place to store the index of the first image in the chunk.
+ * @return number of images in the chunk, or 0 if there are none left.
+ */
+int optimize_claim_chunk(Optimize_Worker *worker, int *offset)
+{
+    *offset = atomic_fetch_add(worker->next_image, worker->chunk_size);
+    if (*offset >= worker->end)
+        return 0;
 
-        for (int j = 0; j < network->biases[i].size; j++)
-            network->biases[i].values[j] -= gradient->values[index + j] * step_size;
+    return MIN(worker->chunk_size, worker->end - *offset);
+}
 
-        index += network->biases[i].size;
+/**
+ * @brief Sum a stripe of all the partial gradients into the first one. The partial gradients are added in pairs, then
+ * pairs of pairs and so on, which fixes the order of the additions for a given number of partial gradients and keeps
+ * the rounding error growing with the log of their number rather than the number itself.
+ *
+ * @param partial_gradients partial gradients to sum.
+ * @param count number of partial gradients.
+ * @param start index of the first value of the stripe.
+ * @param end index after the last value of the stripe.
+ */
+void optimize_reduce_stripe(Vector *partial_gradients, int count, int start, int end)
+{
+    for (int step = 1; step < count; step *= 2)
+    {
+        for (int t = 0; t + step < count; t += 2 * step)
+        {
+            real *sum = partial_gradients[t].values;
+            const real *partial = partial_gradients[t + step].values;
+            for (int j = start; j < end; j++)
+                sum[j] += partial[j];
+        }
     }
 }
 
 /**
- * @brief Perform an optimization step on a network with a dataset.
+ * @brief Allocate the transposed derivatives of the first layer's weights that a worker adds to when its inputs are
+ * sparse. Keeping them transposed lets each nonzero input update one contiguous row.
  *
- * @param network network to optimize.
- * @param dataset dataset to optimize for.
- * @param step_size value to multiple gradient by when moving.
- * @return total cost from when the network was run.
+ * @param worker worker to allocate for.
+ * @return zeroed matrix, or a matrix with no values if the inputs are not sparse.
+ */
+Matrix optimize_sparse_dc_dw_malloc(Optimize_Worker *worker)
+{
+    if (!worker->sparse_weights)
+        return (Matrix){0, 0, 0};
+
+    Matrix dc_dw = matrix_malloc(worker->sparse_weights->width, worker->sparse_weights->height);
+    Vector all = vector_view_matrix(&dc_dw);
+    vector_fill_zero(&all);
+
+    return dc_dw;
+}
+
+/**
+ * @brief Add the transposed derivatives of the first layer's weights to the worker's partial gradient and free them.
+ *
+ * @param worker worker the derivatives belong to.
+ * @param sparse_dc_dw derivatives from optimize_sparse_dc_dw_malloc.
+ */
+void optimize_sparse_dc_dw_free(Optimize_Worker *worker, Matrix sparse_dc_dw)
+{
+    if (!sparse_dc_dw.values)
+        return;
+
+    Neural_Net *network = worker->network;
+    Matrix dc_dw = network->weights[0];
+    dc_dw.values = worker->partial_gradients[worker->index].values + (network->weights[0].values - network->values);
+    matrix_add_transposed(&dc_dw, &sparse_dc_dw);
+
+    matrix_free(sparse_dc_dw);
+}
+
+/**
+ * @brief Run the network and perform back propagation on each claimed image individually, adding the gradients to the
+ * worker's partial gradient.
+ *
+ * @param worker worker to run.
  */
-double network_optimize(Neural_Net *network, Dataset *dataset, double step_size)
+void optimize_accumulate_images(Optimize_Worker *worker)
 {
+    Neural_Net *network = worker->network;
+    Dataset *dataset = worker->dataset;
+    Vector *sum_gradient = worker->partial_gradients + worker->index;
+    Profile *profile = worker->profile;
+
     // Create network input vector
     Vector *input = malloc(sizeof(Vector));
     *input = vector_malloc(dataset->images->size);
 
     // Create network output vectors
-    Vector *raw_node_values = malloc(sizeof(Vector) * network->layers);
     Vector *node_values = malloc(sizeof(Vector) * (network->layers + 1));
-    node_values = node_values + 1; // Offset so that it lines up with raw node values (as node values needs to contain
-                                   // the input while there is no raw node values equivalent)
+    node_values = node_values + 1; // Offset so that node_values[-1] is the input
     for (int i = 0; i < network->layers; i++)
-    {
-        raw_node_values[i] = vector_malloc(network->biases[i].size);
         node_values[i] = vector_malloc(network->biases[i].size);
-        i = i;
+
+    // Only the cost of a softmax output needs the raw node values of the last layer
+    const int last = network->layers - 1;
+    Vector *raw_output = 0;
+    if (network->output == OUTPUT_SOFTMAX)
+    {
+        raw_output = malloc(sizeof(Vector));
+        *raw_output = vector_malloc(network->biases[last].size);
     }
 
     // Create backpropagation input vector
     Vector *expected_result = malloc(sizeof(Vector));
     *expected_result = vector_malloc(network->biases[network->layers - 1].size);
 
-    // Create backpropagation output vetors
-    Vector *single_gradient = malloc(sizeof(Vector));
-    Vector *sum_gradient = malloc(sizeof(Vector));
-    *single_gradient = vector_malloc(network->total_values);
-    *sum_gradient = vector_calloc(network->total_values);
+    // Create backpropagation workspace
+    Backprop_Workspace workspace = backprop_workspace_malloc(network, 1);
+    Matrix sparse_dc_dw = optimize_sparse_dc_dw_malloc(worker);
 
-    double cost = 0;
-    int correct_guesses = 0;
     // Run network and perform back propagation on each item
-    for (int i = 0; i < dataset->count; i++)
+    int offset, count;
+    while ((count = optimize_claim_chunk(worker, &offset)) > 0)
     {
-        // TODO: determain which alternative is better
-        vector_fill(input, dataset->images[i].data);
-        // input->values = dataset->images[i].data;
+        for (int i = offset; i < offset + count; i++)
+        {
+            uint64_t start = profile_start(profile);
+            const Image *image = dataset_image(dataset, i);
 
-        node_values[-1] = *input;
-        network_run(raw_node_values, node_values, network, input);
+            // Use the prefetched row of the image if there is one, otherwise convert it into the input vector
+            Vector image_input = *input;
+            if (worker->inputs)
+                image_input = vector_view_row(worker->inputs, i);
+            else if (worker->sparse_weights)
+                image_convert_sparse(input->values, image);
+            else
+                image_convert(input->values, image);
 
-        vector_fill_zero(expected_result);
-        expected_result->values[dataset->images[i].label] = 1;
+            // With sparse inputs the input vector holds just the nonzero values
+            Sparse_Vector sparse_input, *sparse = 0;
+            if (worker->sparse_weights)
+            {
+                sparse_input.count = image->nonzero_count;
+                sparse_input.indices = image->nonzero_indices;
+                sparse_input.values = image_input.values;
+                sparse = &sparse_input;
+            }
 
-        correct_guesses += dataset->images[i].label == vector_max_index(node_values + (network->layers - 1));
+            vector_fill_zero(expected_result);
+            expected_result->values[image->label] = 1;
+            profile_stop(profile, PROFILE_GATHER, start);
 
-        cost += vector_sq_diff_sum(expected_result, node_values + (network->layers - 1));
+            start = profile_start(profile);
+            node_values[-1] = image_input;
+            network_run(raw_output, node_values, network, &image_input, sparse, worker->sparse_weights);
 
-        backprop_calc_grad(single_gradient, network, raw_node_values, node_values, expected_result);
+            worker->correct_guesses += image->label == vector_max_index(node_values + last);
+            worker->cost += network_cost(network, raw_output, node_values + last, expected_result);
+            profile_stop(profile, PROFILE_FORWARD, start);
 
-        vector_add(sum_gradient, single_gradient);
+            start = profile_start(profile);
+            backprop_calc_grad(sum_gradient, &workspace, network, node_values, expected_result, sparse, &sparse_dc_dw);
+            profile_stop(profile, PROFILE_BACKWARD, start);
+        }
     }
 
-    printf("\nGradient magnitude: %f\n", vector_magnitude(sum_gradient));
-    printf("Total cost: %f\n", cost);
-    printf("Corrent guesses: %i out of %i\n", correct_guesses, dataset->count);
-    network_adjust(network, sum_gradient, step_size / dataset->count);
-
     // Free values
     vector_free_p(input);
     for (int i = 0; i < network->layers; i++)
-    {
-        vector_free(raw_node_values[i]);
         vector_free(node_values[i]);
-    }
-    free(raw_node_values);
     free(node_values - 1);
+    if (raw_output)
+        vector_free_p(raw_output);
     vector_free_p(expected_result);
-    vector_free_p(single_gradient);
-    vector_free_p(sum_gradient);
+    backprop_workspace_free(workspace);
+    optimize_sparse_dc_dw_free(worker, sparse_dc_dw);
+}
+
+/**
+ * @brief Run each claimed chunk of images through the network as a single batch, adding the gradients to the worker's
+ * partial gradient.
+ *
+ * @param worker worker to run.
+ */
+void optimize_accumulate_batches(Optimize_Worker *worker)
+{
+    Neural_Net *network = worker->network;
+    Dataset *dataset = worker->dataset;
+    Vector *sum_gradient = worker->partial_gradients + worker->index;
+    Profile *profile = worker->profile;
+    const int capacity = worker->chunk_size;
+
+    // Create network input matrix
+    Matrix *input = malloc(sizeof(Matrix));
+    *input = matrix_malloc(dataset->images->size, capacity);
+
+    // Create network output matrices
+    Matrix *node_values = malloc(sizeof(Matrix) * (network->layers + 1));
+    node_values = node_values + 1; // Offset so that node_values[-1] is the input
+    for (int i = 0; i < network->layers; i++)
+        node_values[i] = matrix_malloc(network->biases[i].size, capacity);
+
+    // Only the cost of a softmax output needs the raw node values of the last layer
+    const int last = network->layers - 1;
+    Matrix *raw_output = 0;
+    if (network->output == OUTPUT_SOFTMAX)
+    {
+        raw_output = malloc(sizeof(Matrix));
+        *raw_output = matrix_malloc(network->biases[last].size, capacity);
+    }
+
+    // Create backpropagation input matrix
+    Matrix *expected_results = malloc(sizeof(Matrix));
+    *expected_results = matrix_malloc(network->biases[network->layers - 1].size, capacity);
+
+    // Create sparse inputs, used in place of the input matrix when the dataset has been sparsified
+    Sparse_Vector *sparse = 0;
+    if (worker->sparse_weights)
+        sparse = malloc(sizeof(Sparse_Vector) * capacity);
+
+    // Create backpropagation workspace
+    Backprop_Workspace workspace = backprop_workspace_malloc(network, capacity);
+    Matrix sparse_dc_dw = optimize_sparse_dc_dw_malloc(worker);
+
+    int offset, count;
+    while ((count = optimize_claim_chunk(worker, &offset)) > 0)
+    {
+        // Shrink the matrices to the size of this chunk
+        input->height = count;
+        expected_results->height = count;
+        for (int i = 0; i < network->layers; i++)
+            node_values[i].height = count;
+        if (raw_output)
+            raw_output->height = count;
+
+        // Prefetched images are already in contiguous rows, otherwise gather the batch into the input matrix
+        uint64_t start = profile_start(profile);
+        Matrix batch_input = *input;
+        if (worker->inputs)
+            batch_input.values = worker->inputs->values + offset * worker->inputs->width;
+
+        Vector expected_all = vector_view_matrix(expected_results);
+        vector_fill_zero(&expected_all);
+        for (int n = 0; n < count; n++)
+        {
+            const Image *image = dataset_image(dataset, offset + n);
+            Vector row = vector_view_row(&batch_input, n);
+            if (!worker->inputs)
+            {
+                if (sparse)
+                    image_convert_sparse(row.values, image);
+                else
+                    image_convert(row.values, image);
+            }
+            if (sparse)
+            {
+                // Each row of the input matrix holds just the nonzero values of its image
+                sparse[n].count = image->nonzero_count;
+                sparse[n].indices = image->nonzero_indices;
+                sparse[n].values = row.values;
+            }
+            expected_results->values[n * expected_results->width + image->label] = 1;
+        }
+        profile_stop(profile, PROFILE_GATHER, start);
+
+        start = profile_start(profile);
+        node_values[-1] = batch_input;
+        network_run_batch(raw_output, node_values, network, &batch_input, sparse, worker->sparse_weights);
+
+        for (int n = 0; n < count; n++)
+        {
+            Vector raw_row = raw_output ? vector_view_row(raw_output, n) : (Vector){0};
+            Vector row = vector_view_row(node_values + last, n);
+            Vector expected_row = vector_view_row(expected_results, n);
+            worker->cost += network_cost(network, &raw_row, &row, &expected_row);
+            worker->correct_guesses += dataset_image(dataset, offset + n)->label == vector_max_index(&row);
+        }
+        profile_stop(profile, PROFILE_FORWARD, start);
+
+        start = profile_start(profile);
+        backprop_calc_grad_batch(sum_gradient, &workspace, network, node_values, expected_results, sparse,
+                                 &sparse_dc_dw);
+        profile_stop(profile, PROFILE_BACKWARD, start);
+    }
+
+    // Free values
+    matrix_free_p(input);
+    for (int i = 0; i < network->layers; i++)
+        matrix_free(node_values[i]);
+    free(node_values - 1);
+    if (raw_output)
+        matrix_free_p(raw_output);
+    matrix_free_p(expected_results);
+    free(sparse);
+    backprop_workspace_free(workspace);
+    optimize_sparse_dc_dw_free(worker, sparse_dc_dw);
+}
+
+/**
+ * @brief Run a worker for one optimization step. Accumulates gradients for chunks of the dataset until there are none
+ * left, then sums one stripe of all the workers' partial gradients into the first partial gradient. Workers beyond the
+ * number the step needs only wait for the others.
+ *
+ * @param worker worker to run.
+ */
+void optimize_worker_run(Optimize_Worker *worker)
+{
+    const int active = worker->index < worker->count;
+    if (active)
+    {
+        vector_fill_zero(worker->partial_gradients + worker->index);
+        if (worker->batched)
+            optimize_accumulate_batches(worker);
+        else
+            optimize_accumulate_images(worker);
+    }
+
+    // Wait for all partial gradients to be complete
+    uint64_t timer = profile_start(worker->profile);
+    pthread_barrier_wait(worker->barrier);
+    profile_stop(worker->profile, PROFILE_WAIT, timer);
+    if (!active)
+        return;
+
+    // Reduce this worker's stripe of the partial gradients into the first one
+    timer = profile_start(worker->profile);
+    const int size = worker->partial_gradients->size;
+    const int stripe = (size + worker->count - 1) / worker->count;
+    const int start = MIN(size, stripe * worker->index);
+    const int end = MIN(size, start + stripe);
+    optimize_reduce_stripe(worker->partial_gradients, worker->count, start, end);
+    profile_stop(worker->profile, PROFILE_REDUCE, timer);
+}
+
+/**
+ * @brief Entry point of a pool thread. Runs the thread's worker for each optimization step until the pool is stopped.
+ *
+ * @param arg worker to run.
+ * @return nothing.
+ */
+void *optimize_pool_run(void *arg)
+{
+    Optimize_Worker *worker = arg;
+    Optimize_Pool *pool = worker->pool;
+
+    int step = 0;
+    while (1)
+    {
+        // Sleep until the next step has been set up or the pool is stopped
+        pthread_mutex_lock(&pool->lock);
+        while (pool->step == step && !pool->stopping)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        step = pool->step;
+        const int stopping = pool->stopping;
+        pthread_mutex_unlock(&pool->lock);
+        if (stopping)
+            return 0;
+
+        optimize_worker_run(worker);
+
+        // Let the calling thread know that this worker's stripe of the gradient is summed
+        pthread_barrier_wait(&pool->barrier);
+    }
+}
+
+/**
+ * @brief Stop the threads of a pool and free it.
+ *
+ * @param pool pool to stop, or 0 to do nothing.
+ */
+void optimize_pool_stop(Optimize_Pool *pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int t = 1; t < pool->started; t++)
+        pthread_join(pool->handles[t], 0);
+
+    for (int t = 0; t < pool->threads; t++)
+        vector_free(pool->partial_gradients[t]);
+    free(pool->partial_gradients);
+    free(pool->workers);
+    free(pool->handles);
+    free(pool->slice_positions);
+    free(pool->profiles);
+    matrix_free(pool->sparse_weights);
+    pthread_barrier_destroy(&pool->barrier);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool);
+}
+
+/**
+ * @brief Start the worker threads for training a network. The calling thread acts as the first worker, so one fewer
+ * thread than options->threads is created.
+ *
+ * @param network network that will be optimized.
+ * @param options options to train with. Only the number of threads and whether there is a profile are used.
+ * @return a new pool, which must be stopped with optimize_pool_stop, or 0 if memory could not be allocated or a thread
+ * could not be started.
+ */
+Optimize_Pool *optimize_pool_start(Neural_Net *network, Train_Options *options)
+{
+    const int threads = MAX(1, options->threads);
+
+    Optimize_Pool *pool = calloc(1, sizeof(Optimize_Pool));
+    pool->threads = threads;
+    pool->workers = calloc(threads, sizeof(Optimize_Worker));
+    pool->partial_gradients = calloc(threads, sizeof(Vector));
+    pool->handles = malloc(sizeof(pthread_t) * threads);
+    pool->slice_positions = malloc(sizeof(atomic_int) * threads);
+    // Each worker records into its own profile so that timing needs no synchronisation
+    pool->profiles = options->profile ? calloc(threads, sizeof(Profile)) : 0;
+    pthread_barrier_init(&pool->barrier, 0, threads);
+    pthread_mutex_init(&pool->lock, 0);
+    pthread_cond_init(&pool->wake, 0);
+
+    int failed = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        pool->partial_gradients[t] = vector_malloc(network->total_values);
+        failed |= !pool->partial_gradients[t].values;
+
+        pool->workers[t].barrier = &pool->barrier;
+        pool->workers[t].partial_gradients = pool->partial_gradients;
+        pool->workers[t].index = t;
+        pool->workers[t].profile = pool->profiles ? pool->profiles + t : 0;
+        pool->workers[t].pool = pool;
+    }
+
+    // The calling thread is the first worker, so it counts as started
+    pool->started = 1;
+    while (!failed && pool->started < threads)
+    {
+        const int t = pool->started;
+        failed = pthread_create(pool->handles + t, 0, optimize_pool_run, pool->workers + t) != 0;
+        pool->started += !failed;
+    }
+
+    if (failed)
+    {
+        optimize_pool_stop(pool);
+        return 0;
+    }
+
+    return pool;
+}
+
+/**
+ * @brief Perform an optimization step on a network with a dataset. The dataset is split into chunks which are shared
+ * between the workers of the pool, each of which sums the gradients for its chunks into its own partial gradient. The
+ * partial gradients are summed before the network is adjusted. With options->deterministic set, each worker takes a
+ * fixed slice of the dataset instead, so the result only depends on the number of threads and not on their timing.
+ *
+ * @param pool workers to run the step on, from optimize_pool_start for the network.
+ * @param network network to optimize.
+ * @param dataset dataset to optimize for.
+ * @param inputs images of the dataset already converted to network inputs, one row per image, or 0 to convert them as
+ * they are used.
+ * @param options options to train with.
+ * @param optimizer optimizer to adjust the network with, or 0 to move straight down the gradient.
+ * @param step_size value to multiple gradient by when moving.
+ * @return cost and correct guesses from when the network was run.
+ */
+Train_Stats network_optimize(Optimize_Pool *pool, Neural_Net *network, Dataset *dataset, Matrix *inputs,
+                             Train_Options *options, Optimizer *optimizer, double step_size)
+{
+    const int CHUNKS_PER_THREAD = 4;
+    const int MIN_CHUNK_SIZE = 16;
+    const int MAX_BATCH_SIZE = 64;
+
+    const int threads = MAX(1, MIN(pool->threads, dataset->count));
+    int chunk_size = dataset->count;
+    if (threads > 1)
+    {
+        chunk_size = (dataset->count + threads * CHUNKS_PER_THREAD - 1) / (threads * CHUNKS_PER_THREAD);
+        chunk_size = MIN(dataset->count, MAX(chunk_size, MIN_CHUNK_SIZE));
+    }
+    // Larger batches stop fitting in cache, which costs more than the weight reuse gains
+    if (options->batched)
+        chunk_size = MIN(chunk_size, MAX_BATCH_SIZE);
+
+    // Sparse inputs read the first layer's weights one input at a time, so give them a transposed copy where the
+    // weights from each input are contiguous
+    Matrix *sparse_weights = 0;
+    if (dataset->count > 0 && dataset_image(dataset, 0)->nonzero_indices)
+    {
+        if (!pool->sparse_weights.values)
+            pool->sparse_weights = matrix_malloc(network->weights[0].height, network->weights[0].width);
+        sparse_weights = &pool->sparse_weights;
+        matrix_transpose(sparse_weights, network->weights);
+    }
+
+    // In deterministic mode each worker has its own position in its own slice
+    atomic_store(&pool->next_image, 0);
+    Optimize_Worker *workers = pool->workers;
+    for (int t = 0; t < pool->threads; t++)
+    {
+        workers[t].network = network;
+        workers[t].dataset = dataset;
+        workers[t].inputs = inputs;
+        workers[t].batched = options->batched;
+        workers[t].chunk_size = chunk_size;
+        workers[t].end = dataset->count;
+        workers[t].next_image = &pool->next_image;
+        if (options->deterministic)
+        {
+            atomic_init(pool->slice_positions + t, (int)((long)dataset->count * t / threads));
+            workers[t].end = (int)((long)dataset->count * (t + 1) / threads);
+            workers[t].next_image = pool->slice_positions + t;
+        }
+        workers[t].count = threads;
+        workers[t].cost = 0;
+        workers[t].correct_guesses = 0;
+        workers[t].sparse_weights = sparse_weights;
+        if (pool->profiles)
+            profile_reset(pool->profiles + t);
+    }
+
+    // Wake the pool's threads, with the calling thread acting as the first worker
+    pthread_mutex_lock(&pool->lock);
+    pool->step++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    optimize_worker_run(workers);
+    pthread_barrier_wait(&pool->barrier);
+
+    // Sparse inputs only use the first layer's weights from their nonzero pixels
+    Train_Stats stats = {dataset->count, 0, 0, (double)dataset->count * network->weights[0].width};
+    if (sparse_weights)
+    {
+        stats.inputs = 0;
+        for (int i = 0; i < dataset->count; i++)
+            stats.inputs += dataset_image(dataset, i)->nonzero_count;
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        stats.cost += workers[t].cost;
+        stats.correct_guesses += workers[t].correct_guesses;
+        if (pool->profiles && options->profile)
+            profile_add(options->profile, pool->profiles + t);
+    }
+
+    uint64_t start = profile_start(options->profile);
+    if (optimizer)
+    {
+        Vector values = network_view_values(network);
+        optimizer_step(optimizer, &values, pool->partial_gradients, 1.0 / dataset->count, step_size);
+    }
+    else
+        network_adjust(network, pool->partial_gradients, step_size / dataset->count);
+    profile_stop(options->profile, PROFILE_ADJUST, start);
+
+    return stats;
+}
+
+/**
+ * @brief Create the default set of training options.
+ *
+ * @return default training options.
+ */
+Train_Options train_options_default()
+{
+    Train_Options options;
+    options.iterations = 5;
+    options.num_groups = 20;
+    options.step_size = 0.1;
+    options.batched = 1;
+    options.threads = 1;
+    options.prefetch = 1;
+    options.deterministic = 0;
+    options.verbose = 1;
+    options.profile = 0;
+    options.optimizer = OPTIMIZER_SGD;
+    options.momentum = 0.9;
+    options.seed = 1;
 
-    return cost;
+    return options;
 }
 
 /**
- * @brief Train a neural network on a set of training data for a single iteration.
+ * @brief Train a neural network on a set of training data for a single iteration. While each segment is being
+ * optimized, the images of the next one are converted to network inputs on a separate thread.
  *
+ * @param pool workers to optimize each segment with, from optimize_pool_start for the network.
  * @param network network to train.
  * @param dataset dataset to train with.
- * @param num_groups number of groups to split the training set into each iteration.
+ * @param order order to go through the dataset in, which is randomized at the start of the iteration.
+ * @param rng random number generator to randomize the order with.
+ * @param options options to train with.
+ * @param optimizer optimizer to adjust the network with, or 0 to move straight down the gradient.
  * @param step_size value to multiple gradient by when moving.
- * @return sum of all cost for the iteration.
+ * @return cost and correct guesses summed over the iteration.
  */
-double network_train_iteration(Neural_Net *network, Dataset *dataset, int num_groups, double step_size)
+Train_Stats network_train_iteration(Optimize_Pool *pool, Neural_Net *network, Dataset *dataset, int *order, Rng *rng,
+                                    Train_Options *options, Optimizer *optimizer, double step_size)
 {
-    const int SEGMENT_SIZE = dataset->count / num_groups;
-    image_randomize_order(dataset);
+    const int SEGMENT_SIZE = MAX(1, dataset->count / options->num_groups);
+    uint64_t start = profile_start(options->profile);
+    dataset_shuffle_order(order, dataset->count, rng);
+    Dataset *shuffled = dataset_view(dataset, order);
+    profile_stop(options->profile, PROFILE_SHUFFLE, start);
+
+    // The prefetch thread only helps if it has a core to itself, otherwise it just pushes the converted images out of
+    // cache before they are used. Without a prefetcher each segment converts its own images.
+    const int segments = dataset->count / SEGMENT_SIZE;
+    Prefetcher *prefetcher = 0;
+    if (options->prefetch && sysconf(_SC_NPROCESSORS_ONLN) > 1)
+        prefetcher = prefetch_start(shuffled, SEGMENT_SIZE, segments);
 
-    double cost = 0;
-    for (int i = 0; i < dataset->count / SEGMENT_SIZE; i++)
+    Train_Stats stats = {0, 0, 0, 0};
+    for (int i = 0; i < segments; i++)
     {
-        Dataset *segment = dataset_subset(dataset, SEGMENT_SIZE * i, SEGMENT_SIZE);
-        cost += network_optimize(network, segment, step_size);
+        start = profile_start(options->profile);
+        Prefetch_Batch *batch = prefetcher ? prefetch_next(prefetcher) : 0;
+        profile_stop(options->profile, PROFILE_GATHER, start);
+
+        Dataset *segment = dataset_subset(shuffled, SEGMENT_SIZE * i, SEGMENT_SIZE);
+        Train_Stats segment_stats =
+            network_optimize(pool, network, segment, batch ? &batch->inputs : 0, options, optimizer, step_size);
+        stats.count += segment_stats.count;
+        stats.correct_guesses += segment_stats.correct_guesses;
+        stats.cost += segment_stats.cost;
+        stats.inputs += segment_stats.inputs;
         free(segment);
+
+        if (batch)
+            prefetch_release(prefetcher);
     }
+    if (prefetcher)
+        prefetch_stop(prefetcher);
+    free(shuffled);
+
+    return stats;
 }
 
 /**
- * @brief Train a neural network on a set of training data.
+ * @brief Estimate the floating point operations used to train a network on the images of an iteration. Each weight is
+ * used in a multiply-add when running the network, when calculating its gradient and, for all but the first layer,
+ * when propagating the gradient back to the previous layer. First layer weights are only counted for the inputs that
+ * were used, so sparse inputs count just their nonzero pixels.
  *
- * @param neural_net network to train.
- * @param dataset dataset to train with.
- * @param iterations number of iterations to perform for training.
- * @param num_groups number of groups to split the training set into each iteration.
+ * @param network network being trained.
+ * @param stats statistics of the iteration.
+ * @return floating point operations over the iteration.
+ */
+double network_train_flops(Neural_Net *network, Train_Stats *stats)
+{
+    double flops = 2 * 2 * stats->inputs * network->weights[0].height;
+    for (int i = 1; i < network->layers; i++)
+    {
+        double weights = (double)network->weights[i].width * network->weights[i].height;
+        flops += 2 * weights * 3 * stats->count;
+    }
+
+    return flops;
+}
+
+/**
+ * @brief Print the statistics of a training iteration as a single JSON line.
+ *
+ * @param network network being trained.
+ * @param options options being trained with.
+ * @param iteration index of the iteration.
+ * @param stats statistics of the iteration.
+ * @param seconds time the iteration took.
+ * @param step_size step size the iteration used.
+ */
+void network_print_iteration(Neural_Net *network, Train_Options *options, int iteration, Train_Stats *stats,
+                             double seconds, double step_size)
+{
+    printf("{\"epoch\":%i,\"epochs\":%i,\"images\":%i,\"seconds\":%.4f,\"images_per_sec\":%.0f,\"gflops\":%.3f",
+           iteration + 1, options->iterations, stats->count, seconds, stats->count / seconds,
+           network_train_flops(network, stats) / seconds * 1e-9);
+    printf(",\"cost\":%.4f,\"accuracy\":%.4f,\"output\":\"%s\",\"optimizer\":\"%s\",\"step_size\":%g", stats->cost,
+           stats->count ? (double)stats->correct_guesses / stats->count : 0.0, network_output_name(network->output),
+           optimizer_type_name(options->optimizer), step_size);
+    if (options->profile)
+    {
+        printf(",");
+        profile_print_json(options->profile);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+/**
+ * @brief Get the number of images in each segment when training from a stream. Segments are the same size as they
+ * would be for a dataset of the same size, but are limited so the memory they need does not grow with the stream.
+ *
+ * @param stream stream being trained with.
+ * @param options options being trained with.
+ * @return number of images in each segment.
+ */
+int network_stream_segment_size(Image_Stream *stream, Train_Options *options)
+{
+    const int MAX_SEGMENT_SIZE = 4096;
+
+    return MAX(1, MIN(stream->count / options->num_groups, MAX_SEGMENT_SIZE));
+}
+
+/**
+ * @brief Train a neural network on a stream of training data for a single iteration. The stream is read one segment at
+ * a time, and a final segment that is not full is skipped as it would be for a dataset.
+ *
+ * @param pool workers to optimize each segment with, from optimize_pool_start for the network.
+ * @param network network to train.
+ * @param stream stream to train with, which is rewound at the start of the iteration.
+ * @param segment dataset from stream_dataset_malloc to read each segment into.
+ * @param rng random number generator to shuffle the stream with.
+ * @param options options to train with.
+ * @param optimizer optimizer to adjust the network with, or 0 to move straight down the gradient.
  * @param step_size value to multiple gradient by when moving.
+ * @return cost and correct guesses summed over the iteration, or stats with a count of -1 if the stream could not be
+ * read.
+ */
+Train_Stats network_train_stream_iteration(Optimize_Pool *pool, Neural_Net *network, Image_Stream *stream,
+                                           Dataset *segment, Rng *rng, Train_Options *options, Optimizer *optimizer,
+                                           double step_size)
+{
+    const int SEGMENT_SIZE = network_stream_segment_size(stream, options);
+
+    Train_Stats stats = {0, 0, 0, 0};
+    const Train_Stats error = {-1, 0, 0, 0};
+    if (stream_rewind(stream, rng) != 0)
+        return error;
+
+    while (1)
+    {
+        uint64_t start = profile_start(options->profile);
+        int count = stream_read(stream, segment, SEGMENT_SIZE);
+        profile_stop(options->profile, PROFILE_LOAD, start);
+        if (count < 0)
+            return error;
+        if (count < SEGMENT_SIZE)
+            break;
+
+        Train_Stats segment_stats = network_optimize(pool, network, segment, 0, options, optimizer, step_size);
+        stats.count += segment_stats.count;
+        stats.correct_guesses += segment_stats.correct_guesses;
+        stats.cost += segment_stats.cost;
+        stats.inputs += segment_stats.inputs;
+    }
+
+    return stats;
+}
+
+/**
+ * @brief Train a neural network on either a set of training data or a stream of it.
+ *
+ * @param network network to train.
+ * @param dataset dataset to train with, or 0 to use the stream.
+ * @param stream stream to train with when there is no dataset.
+ * @param options options to train with.
+ * @return 0 if successful, otherwise -1 if the worker threads could not be started or the stream could not be read.
  */
-void network_train(Neural_Net *network, Dataset *dataset, int iterations, int num_groups, double step_size)
+int network_train_source(Neural_Net *network, Dataset *dataset, Image_Stream *stream, Train_Options *options)
 {
+    // The same threads and partial gradients are used for every optimization step
+    Optimize_Pool *pool = optimize_pool_start(network, options);
+    if (!pool)
+        return -1;
+
+    int res = 0;
+    int *order = dataset ? dataset_order_malloc(dataset) : 0;
+    Dataset *segment = dataset ? 0 : stream_dataset_malloc(stream, network_stream_segment_size(stream, options));
+    Optimizer optimizer = optimizer_malloc(options->optimizer, options->momentum, network->total_values);
+    Rng rng = rnd_create(options->seed);
+
+    double step_size = options->step_size;
     double prev_cost = 1.0 / 0.0;
-    for (int i = 0; i < iterations; i++)
+    for (int i = 0; i < options->iterations; i++)
     {
-        printf("\n--- Starting iteration %i of %i ---\n", i + 1, iterations);
-        double cost = network_train_iteration(network, dataset, num_groups, step_size);
-        if (cost > prev_cost * 0.9)
+        if (options->profile)
+            profile_reset(options->profile);
+
+        uint64_t start = profile_now();
+        Train_Stats stats =
+            dataset
+                ? network_train_iteration(pool, network, dataset, order, &rng, options, &optimizer, step_size)
+                : network_train_stream_iteration(pool, network, stream, segment, &rng, options, &optimizer, step_size);
+        double seconds = (profile_now() - start) * 1e-9;
+        if (stats.count < 0)
         {
-            printf("\nHalving step size\n");
-            step_size *= 0.5;
+            res = -1;
+            break;
         }
 
-        prev_cost = cost;
+        if (options->verbose)
+            network_print_iteration(network, options, i, &stats, seconds, step_size);
+
+        if (stats.cost > prev_cost * 0.9)
+            step_size *= 0.5;
+
+        prev_cost = stats.cost;
     }
-}
\ No newline at end of file
+
+    free(order);
+    if (segment)
+        dataset_free_p(segment);
+    optimizer_free(optimizer);
+    optimize_pool_stop(pool);
+
+    return res;
+}
+
+/**
+ * @brief Train a neural network on a set of training data.
+ *
+ * @param neural_net network to train.
+ * @param dataset dataset to train with.
+ * @param options options to train with.
+ * @return 0 if successful, otherwise -1 if the worker threads could not be started.
+ */
+int network_train(Neural_Net *network, Dataset *dataset, Train_Options *options)
+{
+    return network_train_source(network, dataset, 0, options);
+}
+
+/**
+ * @brief Train a neural network on a stream of training data, holding only one segment and the stream's shuffle
+ * buffer in memory at a time.
+ *
+ * @param network network to train.
+ * @param stream stream to train with.
+ * @param options options to train with.
+ * @return 0 if successful, otherwise -1 if the worker threads could not be started or the stream could not be read, in
+ * which case training stops part way through an iteration.
+ */
+int network_train_stream(Neural_Net *network, Image_Stream *stream, Train_Options *options)
+{
+    return network_train_source(network, 0, stream, options);
+}
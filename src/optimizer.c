@@ -0,0 +1,150 @@
+#include <optimizer.h>
+#include <math.h>
+#include <string.h>
+
+/*
+The state of each optimizer is laid out the same as the values of the network (see network_view_values), so a step is
+a single pass over the values, the gradient and the state with no temporary buffers.
+
+    SGD:      v -= step * g
+    Momentum: m = momentum * m + g;                   v -= step * m
+    Nesterov: m = momentum * m + g;                   v -= step * (g + momentum * m)
+    Adam:     m = momentum * m + (1 - momentum) * g;  s = beta2 * s + (1 - beta2) * g^2
+              v -= step * m_hat / (sqrt(s_hat) + epsilon), where m_hat and s_hat are the bias corrected moments
+*/
+
+static const char *OPTIMIZER_NAMES[] = {"sgd", "momentum", "nesterov", "adam"};
+
+/**
+ * @brief Create a new optimizer with its state set to zero.
+ *
+ * @param type kind of optimizer.
+ * @param momentum decay of the velocity for momentum and Nesterov, or of the first moment for Adam.
+ * @param size number of values being optimized.
+ * @return a new optimizer. The state vectors have a size of 0 if the optimizer does not need them.
+ */
+Optimizer optimizer_malloc(Optimizer_Type type, double momentum, int size)
+{
+    Optimizer new;
+    new.type = type;
+    new.momentum = momentum;
+    new.beta2 = 0.999;
+    new.epsilon = 1e-8;
+    new.steps = 0;
+    new.velocity = type == OPTIMIZER_SGD ? (Vector){0, 0} : vector_calloc(size);
+    new.second_moment = type == OPTIMIZER_ADAM ? vector_calloc(size) : (Vector){0, 0};
+
+    return new;
+}
+
+/**
+ * @brief Frees memory used by an optimizer.
+ *
+ * @param o optimizer to free memory of.
+ */
+void optimizer_free(Optimizer o)
+{
+    vector_free(o.velocity);
+    vector_free(o.second_moment);
+}
+
+/**
+ * @brief Find the kind of optimizer with a name.
+ *
+ * @param name name of the optimizer, as returned by optimizer_type_name.
+ * @param type place to store the kind of optimizer.
+ * @return 0 if the name was found, otherwise -1.
+ */
+int optimizer_parse_type(const char *name, Optimizer_Type *type)
+{
+    for (int i = 0; i < (int)(sizeof(OPTIMIZER_NAMES) / sizeof(OPTIMIZER_NAMES[0])); i++)
+    {
+        if (strcmp(name, OPTIMIZER_NAMES[i]) == 0)
+        {
+            *type = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Get the name of a kind of optimizer.
+ *
+ * @param type kind of optimizer.
+ * @return name of the optimizer.
+ */
+const char *optimizer_type_name(Optimizer_Type type)
+{
+    return OPTIMIZER_NAMES[type];
+}
+
+/**
+ * @brief Move values down a gradient, updating the optimizer's state in the same pass.
+ *
+ * @param o optimizer to step with.
+ * @param values values to adjust.
+ * @param gradient gradient of the cost with respect to the values.
+ * @param gradient_scale value to multiply the gradient by before using it, such as one over the number of inputs it
+ * was summed over.
+ * @param step_size value to multiple the update by when moving.
+ */
+void optimizer_step(Optimizer *o, Vector *values, Vector *gradient, double gradient_scale, double step_size)
+{
+    real *restrict v = values->values;
+    const real *restrict g = gradient->values;
+    real *restrict m = o->velocity.values;
+    real *restrict s = o->second_moment.values;
+    const int n = values->size;
+    const real scale = gradient_scale;
+    const real mu = o->momentum;
+
+    o->steps++;
+    switch (o->type)
+    {
+    case OPTIMIZER_SGD:
+    {
+        const real step = step_size * gradient_scale;
+        for (int i = 0; i < n; i++)
+            v[i] -= step * g[i];
+        break;
+    }
+    case OPTIMIZER_MOMENTUM:
+    {
+        const real step = step_size;
+        for (int i = 0; i < n; i++)
+        {
+            m[i] = mu * m[i] + scale * g[i];
+            v[i] -= step * m[i];
+        }
+        break;
+    }
+    case OPTIMIZER_NESTEROV:
+    {
+        const real step = step_size;
+        for (int i = 0; i < n; i++)
+        {
+            real grad = scale * g[i];
+            m[i] = mu * m[i] + grad;
+            v[i] -= step * (grad + mu * m[i]);
+        }
+        break;
+    }
+    case OPTIMIZER_ADAM:
+    {
+        // Fold both bias corrections into the step size
+        const real step = step_size * sqrt(1 - pow(o->beta2, o->steps)) / (1 - pow(mu, o->steps));
+        const real beta2 = o->beta2;
+        const real epsilon = o->epsilon;
+        for (int i = 0; i < n; i++)
+        {
+            real grad = scale * g[i];
+            m[i] = mu * m[i] + (1 - mu) * grad;
+            s[i] = beta2 * s[i] + (1 - beta2) * grad * grad;
+            v[i] -= step * m[i] / (sqrt(s[i]) + epsilon);
+        }
+        break;
+    }
+    }
+}
\ No newline at end of file
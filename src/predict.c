@@ -0,0 +1,128 @@
+#include <predict.h>
+#include <stdlib.h>
+#include <math_ext.h>
+#include <layer.h>
+
+/**
+ * @brief Allocates memory for running a network forward without keeping any values needed for training.
+ *
+ * @param network network to run.
+ * @param batch_size maximum number of inputs that will be run at once.
+ * @return a new predictor with two buffers large enough for the widest layer of the network. If the network has a
+ * specialised topology, the predictor holds a packed copy of its weights, so it must be made again after the network
+ * changes.
+ */
+Predictor predictor_malloc(Neural_Net *network, int batch_size)
+{
+    int widest = 0;
+    for (int i = 0; i < network->layers; i++)
+        widest = MAX(widest, network->biases[i].size);
+
+    Predictor new;
+    new.network = network;
+    new.batch_size = batch_size;
+    new.buffers[0] = matrix_malloc(widest, batch_size);
+    new.buffers[1] = matrix_malloc(widest, batch_size);
+
+    new.topology = topology_find(network);
+    new.packed = new.topology ? topology_pack(new.topology, network) : 0;
+    if (!new.packed)
+        new.topology = 0;
+
+    return new;
+}
+
+/**
+ * @brief Frees memory used by a predictor. The network is not freed.
+ *
+ * @param p predictor to free memory of.
+ */
+void predictor_free(Predictor p)
+{
+    matrix_free(p.buffers[0]);
+    matrix_free(p.buffers[1]);
+    free(p.packed);
+}
+
+/**
+ * @brief Run a network on a batch of inputs and find the most likely label for each.
+ *
+ * @param predictor predictor to run the network with.
+ * @param input inputs to the network, one row per input. There must not be more inputs than the predictor's batch
+ * size.
+ * @param labels place to store the index of the greatest output for each input, or 0 if not needed.
+ * @return output of the network, one row per input. The matrix belongs to the predictor and is overwritten by the next
+ * prediction.
+ */
+Matrix *network_predict_batch(Predictor *predictor, Matrix *input, int *labels)
+{
+    Neural_Net *network = predictor->network;
+
+    if (input->height > predictor->batch_size || input->width != network->weights[0].width)
+        return 0;
+
+    Matrix *active_layer = input;
+    if (predictor->topology)
+    {
+        // Specialised forward pass for a fixed topology
+        active_layer = predictor->buffers;
+        active_layer->width = network->biases[network->layers - 1].size;
+        active_layer->height = input->height;
+        predictor->topology->run(active_layer->values, predictor->packed, input->values, input->height,
+                                 network->output == OUTPUT_SOFTMAX);
+    }
+    else
+    {
+        for (int i = 0; i < network->layers; i++)
+        {
+            Matrix *output = predictor->buffers + (i % 2);
+            output->width = network->biases[i].size;
+            output->height = input->height;
+
+            const int softmax = i == network->layers - 1 && network->output == OUTPUT_SOFTMAX;
+            layer_forward(0, output, active_layer, network->weights + i, network->biases + i, softmax);
+
+            active_layer = output;
+        }
+    }
+
+    if (labels)
+    {
+        for (int n = 0; n < active_layer->height; n++)
+        {
+            Vector row = vector_view_row(active_layer, n);
+            labels[n] = vector_max_index(&row);
+        }
+    }
+
+    return active_layer;
+}
+
+/**
+ * @brief Run a network on a single input and find the most likely label.
+ *
+ * @param predictor predictor to run the network with.
+ * @param input input to the network.
+ * @param scores vector to copy the output of the network to, or 0 if not needed.
+ * @return index of the greatest output, or -1 if the input does not match the network.
+ */
+int network_predict(Predictor *predictor, Vector *input, Vector *scores)
+{
+    Matrix input_batch;
+    input_batch.width = input->size;
+    input_batch.height = 1;
+    input_batch.values = input->values;
+
+    int label;
+    Matrix *output = network_predict_batch(predictor, &input_batch, &label);
+    if (!output)
+        return -1;
+
+    if (scores)
+    {
+        Vector row = vector_view_row(output, 0);
+        vector_copy(scores, &row);
+    }
+
+    return label;
+}
\ No newline at end of file
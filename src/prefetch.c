@@ -0,0 +1,180 @@
+#include <prefetch.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <math_ext.h>
+
+/*
+A prefetcher converts the images of a dataset into batches of network inputs on its own thread, so the threads running
+the network find each batch already in one contiguous block of memory. Batches are handed over through a ring of
+PREFETCH_SLOTS buffers with a single producer (the prefetch thread) and a single consumer (the training loop):
+
+    produced: number of batches the producer has finished, only written by the producer
+    consumed: number of batches the consumer has released, only written by the consumer
+
+Batch b lives in slot b % PREFETCH_SLOTS. The producer may fill batch b once b - consumed < PREFETCH_SLOTS and the
+consumer may read it once produced > b, so neither side ever takes a lock. Each counter is stored with release order
+after the slot it covers has been written or read, and loaded with acquire order before the slot is touched.
+*/
+
+#define PREFETCH_ALIGNMENT 64
+
+/**
+ * @brief Wait a little before checking a counter of the ring again. Starts by spinning, as a batch is usually close to
+ * ready, then yields the processor and finally sleeps so a waiting thread does not take time from the others.
+ *
+ * @param spins number of times this wait has backed off so far, which is incremented.
+ */
+void prefetch_backoff(int *spins)
+{
+    const int SPIN_LIMIT = 64;
+    const int YIELD_LIMIT = 256;
+
+    (*spins)++;
+    if (*spins < SPIN_LIMIT)
+        return;
+
+    if (*spins < YIELD_LIMIT)
+    {
+        sched_yield();
+        return;
+    }
+
+    struct timespec pause = {0, 20000};
+    nanosleep(&pause, 0);
+}
+
+/**
+ * @brief Convert the images of a batch into its slot. Sparsified images store just their nonzero values at the start
+ * of their row.
+ *
+ * @param p prefetcher the batch belongs to.
+ * @param batch slot to fill.
+ * @param index index of the batch.
+ */
+void prefetch_fill(Prefetcher *p, Prefetch_Batch *batch, int index)
+{
+    batch->offset = index * p->batch_size;
+    batch->count = MIN(p->batch_size, p->dataset->count - batch->offset);
+    batch->inputs.height = batch->count;
+
+    for (int n = 0; n < batch->count; n++)
+    {
+        const Image *image = dataset_image(p->dataset, batch->offset + n);
+        real *row = batch->inputs.values + n * batch->inputs.width;
+        if (image->nonzero_indices)
+            image_convert_sparse(row, image);
+        else
+            image_convert(row, image);
+    }
+}
+
+/**
+ * @brief Entry point of the prefetch thread. Fills each batch in turn as soon as its slot has been released.
+ *
+ * @param arg prefetcher to run.
+ * @return nothing.
+ */
+void *prefetch_run(void *arg)
+{
+    Prefetcher *p = arg;
+
+    for (int b = 0; b < p->batches; b++)
+    {
+        int spins = 0;
+        while (b - atomic_load_explicit(&p->consumed, memory_order_acquire) >= PREFETCH_SLOTS)
+        {
+            if (atomic_load_explicit(&p->stopping, memory_order_relaxed))
+                return 0;
+            prefetch_backoff(&spins);
+        }
+
+        prefetch_fill(p, p->slots + (b % PREFETCH_SLOTS), b);
+        atomic_store_explicit(&p->produced, b + 1, memory_order_release);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Start converting a dataset into batches on a new thread.
+ *
+ * @param dataset dataset to convert, in the order the batches will be used. It must outlive the prefetcher.
+ * @param batch_size number of images in each batch.
+ * @param batches number of batches to convert.
+ * @return a new prefetcher, or 0 if memory could not be allocated or the thread could not be started.
+ */
+Prefetcher *prefetch_start(Dataset *dataset, int batch_size, int batches)
+{
+    if (batch_size <= 0 || batches <= 0 || batches * batch_size > dataset->count)
+        return 0;
+
+    Prefetcher *p = malloc(sizeof(Prefetcher));
+    p->dataset = dataset;
+    p->batch_size = batch_size;
+    p->batches = batches;
+    atomic_init(&p->produced, 0);
+    atomic_init(&p->consumed, 0);
+    atomic_init(&p->stopping, 0);
+
+    int failed = 0;
+    for (int i = 0; i < PREFETCH_SLOTS; i++)
+    {
+        p->slots[i].inputs = matrix_malloc_aligned(dataset->images->size, batch_size, PREFETCH_ALIGNMENT);
+        failed |= !p->slots[i].inputs.values;
+    }
+
+    if (failed || pthread_create(&p->thread, 0, prefetch_run, p) != 0)
+    {
+        for (int i = 0; i < PREFETCH_SLOTS; i++)
+            matrix_free(p->slots[i].inputs);
+        free(p);
+        return 0;
+    }
+
+    return p;
+}
+
+/**
+ * @brief Wait for the next batch to be converted.
+ *
+ * @param p prefetcher to take the batch from.
+ * @return the next batch, which stays valid until prefetch_release is called, or 0 if all batches have been taken.
+ */
+Prefetch_Batch *prefetch_next(Prefetcher *p)
+{
+    const int b = atomic_load_explicit(&p->consumed, memory_order_relaxed);
+    if (b >= p->batches)
+        return 0;
+
+    int spins = 0;
+    while (atomic_load_explicit(&p->produced, memory_order_acquire) <= b)
+        prefetch_backoff(&spins);
+
+    return p->slots + (b % PREFETCH_SLOTS);
+}
+
+/**
+ * @brief Hand the batch returned by prefetch_next back to the prefetcher so its slot can be refilled.
+ *
+ * @param p prefetcher the batch came from.
+ */
+void prefetch_release(Prefetcher *p)
+{
+    atomic_fetch_add_explicit(&p->consumed, 1, memory_order_release);
+}
+
+/**
+ * @brief Stop a prefetcher, waiting for its thread to finish, and free it. Any batches not yet taken are dropped.
+ *
+ * @param p prefetcher to stop.
+ */
+void prefetch_stop(Prefetcher *p)
+{
+    atomic_store_explicit(&p->stopping, 1, memory_order_relaxed);
+    pthread_join(p->thread, 0);
+
+    for (int i = 0; i < PREFETCH_SLOTS; i++)
+        matrix_free(p->slots[i].inputs);
+    free(p);
+}
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include <profile.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+Profiles are optional everywhere they are used. Code being profiled takes a Profile pointer that is 0 when profiling is
+off, in which case starting and stopping a timer costs a single branch. Each thread records into its own profile, and
+the profiles are added together afterwards, so recording never needs a lock. Only the phases that were timed since the
+last reset are printed, so a phase that did not happen, such as loading a dataset that was loaded before training, is
+left out rather than shown as taking no time.
+*/
+
+static const char *PHASE_NAMES[PROFILE_PHASES] = {"load",     "shuffle", "gather", "forward",
+                                                  "backward", "wait",    "reduce", "adjust"};
+
+/**
+ * @brief Set all the times in a profile to 0 and mark every phase as not timed.
+ *
+ * @param p profile to reset.
+ */
+void profile_reset(Profile *p)
+{
+    for (int i = 0; i < PROFILE_PHASES; i++)
+        p->ns[i] = 0;
+    p->recorded = 0;
+}
+
+/**
+ * @brief Get the current time.
+ *
+ * @return time in nanoseconds from an arbitrary fixed point.
+ */
+uint64_t profile_now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/**
+ * @brief Start timing a phase.
+ *
+ * @param p profile to record to, or 0 if profiling is off.
+ * @return start time to pass to profile_stop.
+ */
+uint64_t profile_start(Profile *p)
+{
+    if (!p)
+        return 0;
+
+    return profile_now();
+}
+
+/**
+ * @brief Stop timing a phase and add the time taken to a profile.
+ *
+ * @param p profile to record to, or 0 if profiling is off.
+ * @param phase phase being timed.
+ * @param start time returned by profile_start.
+ */
+void profile_stop(Profile *p, Profile_Phase phase, uint64_t start)
+{
+    if (!p)
+        return;
+
+    p->ns[phase] += profile_now() - start;
+    p->recorded |= 1u << phase;
+}
+
+/**
+ * @brief Add the times of one profile to another.
+ *
+ * @param dest profile to add to.
+ * @param src profile to add.
+ */
+void profile_add(Profile *dest, Profile *src)
+{
+    for (int i = 0; i < PROFILE_PHASES; i++)
+        dest->ns[i] += src->ns[i];
+    dest->recorded |= src->recorded;
+}
+
+/**
+ * @brief Print the times of the phases timed in a profile in seconds as a JSON object member named "phases".
+ *
+ * @param p profile to print.
+ */
+void profile_print_json(Profile *p)
+{
+    printf("\"phases\":{");
+    const char *separator = "";
+    for (int i = 0; i < PROFILE_PHASES; i++)
+    {
+        if (!(p->recorded & (1u << i)))
+            continue;
+        printf("%s\"%s\":%.6f", separator, PHASE_NAMES[i], p->ns[i] * 1e-9);
+        separator = ",";
+    }
+    printf("}");
+}
\ No newline at end of file
@@ -1,32 +1,222 @@
-#include <stdlib.h>
+#include <random.h>
 #include <math.h>
+#include <math_ext.h>
 
-double rnd_double()
+/*
+Random numbers come from xoshiro256** generators. A generator is a small struct owned by whoever uses it, so there is
+no hidden shared state: each thread uses its own generator, and the same seed always gives the same sequence.
+
+Independent generators for threads or layers are made with rnd_split, which hands out the current sequence and jumps
+the parent 2^128 values ahead. The sequences handed out never overlap, and they depend only on the seed and the order
+of the splits, not on which thread uses them or when.
+*/
+
+/**
+ * @brief Rotate the bits of a 64 bit integer to the left.
+ *
+ * @param x value to rotate.
+ * @param k number of bits to rotate by.
+ * @return rotated value.
+ */
+static inline uint64_t rnd_rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/**
+ * @brief Create a generator from a seed. The seed is expanded with splitmix64 so that similar seeds give unrelated
+ * sequences and the state is never all zero.
+ *
+ * @param seed seed of the generator.
+ * @return a new generator.
+ */
+Rng rnd_create(uint64_t seed)
 {
-    double res = (double)rand() / RAND_MAX;
+    Rng rng;
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        rng.s[i] = z ^ (z >> 31);
+    }
+
+    return rng;
+}
+
+/**
+ * @brief Get the next 64 random bits of a generator.
+ *
+ * @param rng generator to advance.
+ * @return 64 random bits.
+ */
+uint64_t rnd_next(Rng *rng)
+{
+    uint64_t *s = rng->s;
+    const uint64_t res = rnd_rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rnd_rotl(s[3], 45);
+
     return res;
 }
 
-double rnd_normal(double std_dev)
+/**
+ * @brief Create a generator for another thread or task. The new generator continues the sequence of the parent, which
+ * jumps 2^128 values ahead so the two never overlap.
+ *
+ * @param rng parent generator.
+ * @return a new generator.
+ */
+Rng rnd_split(Rng *rng)
 {
-    static int res2_set = 0;
-    static double res2;
+    static const uint64_t JUMP[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c};
 
-    if (res2_set)
+    Rng res = *rng;
+
+    uint64_t s[4] = {0, 0, 0, 0};
+    for (int i = 0; i < 4; i++)
     {
-        res2_set = 0;
-        return res2 * std_dev;
+        for (int b = 0; b < 64; b++)
+        {
+            if (JUMP[i] & ((uint64_t)1 << b))
+            {
+                for (int j = 0; j < 4; j++)
+                    s[j] ^= rng->s[j];
+            }
+            rnd_next(rng);
+        }
     }
+    for (int j = 0; j < 4; j++)
+        rng->s[j] = s[j];
+
+    return res;
+}
+
+/**
+ * @brief Convert 64 random bits to a double in [0, 1) using the top 53 bits.
+ *
+ * @param bits random bits.
+ * @return random double.
+ */
+static inline double rnd_bits_to_double(uint64_t bits)
+{
+    return (bits >> 11) * 0x1.0p-53;
+}
 
-    double a = rnd_double();
-    double b = rnd_double();
+/**
+ * @brief Get a random double between 0 (inclusive) and 1 (exclusive).
+ *
+ * @param rng generator to use.
+ * @return random double.
+ */
+double rnd_double(Rng *rng)
+{
+    return rnd_bits_to_double(rnd_next(rng));
+}
+
+/**
+ * @brief Get a random integer below a limit with no bias, using a multiply and a rarely needed rejection rather than a
+ * division.
+ *
+ * @param rng generator to use.
+ * @param n limit, which must be greater than 0.
+ * @return random integer in [0, n).
+ */
+uint32_t rnd_below(Rng *rng, uint32_t n)
+{
+    uint64_t m = (rnd_next(rng) >> 32) * n;
+    uint32_t low = (uint32_t)m;
+    if (low < n)
+    {
+        const uint32_t threshold = -n % n;
+        while (low < threshold)
+        {
+            m = (rnd_next(rng) >> 32) * n;
+            low = (uint32_t)m;
+        }
+    }
 
-    double r = sqrt(-2 * log(a));
-    double t = 2 * M_PI * b;
-    double res1 = r * cos(t);
-    res2 = r * sin(t);
+    return m >> 32;
+}
 
-    res2_set = 1;
+/**
+ * @brief Sample a normal distribution with a mean of 0. Only one of the pair of values made by the Box-Muller transform
+ * is used, so that the generator is the only state; use rnd_fill_normal to sample many values.
+ *
+ * @param rng generator to use.
+ * @param std_dev standard deviation of the distribution.
+ * @return random value.
+ */
+double rnd_normal(Rng *rng, double std_dev)
+{
+    double a = 1 - rnd_double(rng);
+    double b = rnd_double(rng);
 
-    return res1 * std_dev;
+    return sqrt(-2 * log(a)) * cos(2 * M_PI * b) * std_dev;
 }
+
+/**
+ * @brief Fill memory with samples of a normal distribution with a mean of 0. The uniform values for a block are drawn
+ * from four interleaved generators so their updates are independent and can be vectorised, then the Box-Muller
+ * transform is applied to the whole block, using both values of each pair.
+ *
+ * @param rng generator to use. Four generators are split from it, so the values depend only on the state of rng.
+ * @param dest memory to fill.
+ * @param n number of values.
+ * @param std_dev standard deviation of the distribution.
+ */
+void rnd_fill_normal(Rng *rng, real *dest, int n, double std_dev)
+{
+    enum
+    {
+        LANES = 4,
+        BLOCK = 256
+    };
+
+    uint64_t s[4][LANES];
+    for (int l = 0; l < LANES; l++)
+    {
+        Rng lane = rnd_split(rng);
+        for (int j = 0; j < 4; j++)
+            s[j][l] = lane.s[j];
+    }
+
+    double u[BLOCK];
+    for (int offset = 0; offset < n; offset += BLOCK)
+    {
+        // Draw uniform values, one from each lane at a time
+        for (int i = 0; i < BLOCK; i += LANES)
+        {
+            for (int l = 0; l < LANES; l++)
+            {
+                const uint64_t res = rnd_rotl(s[1][l] * 5, 7) * 9;
+                const uint64_t t = s[1][l] << 17;
+                s[2][l] ^= s[0][l];
+                s[3][l] ^= s[1][l];
+                s[1][l] ^= s[2][l];
+                s[0][l] ^= s[3][l];
+                s[2][l] ^= t;
+                s[3][l] = rnd_rotl(s[3][l], 45);
+                u[i + l] = rnd_bits_to_double(res);
+            }
+        }
+
+        // Turn each pair of uniform values into a pair of normal values
+        const int count = MIN(BLOCK, n - offset);
+        real *out = dest + offset;
+        for (int i = 0; i < count; i += 2)
+        {
+            const double r = sqrt(-2 * log(1 - u[i])) * std_dev;
+            const double t = 2 * M_PI * u[i + 1];
+            out[i] = r * cos(t);
+            if (i + 1 < count)
+                out[i + 1] = r * sin(t);
+        }
+    }
+}
\ No newline at end of file
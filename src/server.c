@@ -0,0 +1,963 @@
+#include <server.h>
+#include <predict.h>
+#include <math_ext.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+Protocol:
+    Each request is one image of raw uint8 pixels, as many bytes as the network has inputs (784 for 28x28 images).
+    Over a socket each response is a single byte holding the predicted label. Responses are sent in the order the
+    requests were received, so a client can send many requests before reading any responses. In stream mode each
+    response is the predicted label as text followed by a newline.
+
+Requests from every connection go into one queue. A single batching thread waits until either max_batch requests are
+queued or the oldest queued request has waited max_wait_us, then runs all the queued requests through the network as
+one batch.
+
+The batching thread only adds each response to its connection's pending buffer. Every connection has its own writer
+thread that writes those buffers out, so a client that is slow to read its responses cannot hold up the others. A
+connection stops being read from while CONNECTION_MAX_UNANSWERED of its requests are waiting for their responses to be
+written, which bounds its buffers and pushes back on a client that sends without reading.
+
+A socket server runs until it receives SIGINT or SIGTERM. It then stops accepting connections and shuts down the read
+side of every connection, answers the requests already queued and gives the writers SERVER_CLOSE_TIMEOUT_MS to send
+the responses before shutting down the connections completely.
+*/
+
+#define CONNECTION_MAX_UNANSWERED 256
+#define CONNECTION_MAX_RESPONSE 16
+#define SERVER_CLOSE_TIMEOUT_MS 2000
+
+typedef struct Connection_Set Connection_Set;
+
+/**
+ * @brief A source of requests that responses are written back to. Responses are added to pending and swapped with
+ * writing by the connection's writer thread, which then writes them out without holding the lock.
+ */
+typedef struct Connection
+{
+    int in_fd;
+    int out_fd;
+    int text;
+    atomic_int references;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int reading;
+    int closing;
+    int unanswered;
+    int failed;
+    uint8_t *pending;
+    int pending_size;
+    int pending_count;
+    uint8_t *writing;
+    Connection_Set *set;
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
+/**
+ * @brief The open connections of a socket server, so that they can be shut down when the server stops. A connection
+ * is counted as a reader until its reader thread finishes, and as open until it is freed.
+ */
+struct Connection_Set
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int readers;
+    int open;
+    Connection *first;
+};
+
+/**
+ * @brief Queue of requests waiting to be run through the network. The pixels of each request are stored in one
+ * buffer with a slot for each request.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    int image_size;
+    int capacity;
+    int head;
+    int count;
+    int closed;
+    uint8_t *pixels;
+    Connection **connections;
+    struct timespec *arrivals;
+} Request_Queue;
+
+/**
+ * @brief State shared with the thread reading requests from a connection.
+ */
+typedef struct
+{
+    Request_Queue *queue;
+    Connection *connection;
+} Reader;
+
+/**
+ * @brief Create the default set of server options.
+ *
+ * @return default server options.
+ */
+Server_Options server_options_default()
+{
+    Server_Options options;
+    options.max_batch = 64;
+    options.max_wait_us = 1000;
+    options.queue_size = 4096;
+
+    return options;
+}
+
+/**
+ * @brief Create a new connection, which is being read from until connection_stop_reading is called. Socket
+ * connections are closed once they are released, stream connections are left open.
+ *
+ * @param in_fd file descriptor to read requests from.
+ * @param out_fd file descriptor to write responses to.
+ * @param text whether the connection is a stream that responses are written to as text.
+ * @return the new connection, holding one reference.
+ */
+Connection *connection_malloc(int in_fd, int out_fd, int text)
+{
+    Connection *new = malloc(sizeof(Connection));
+    new->in_fd = in_fd;
+    new->out_fd = out_fd;
+    new->text = text;
+    atomic_init(&new->references, 1);
+    pthread_mutex_init(&new->lock, 0);
+    pthread_cond_init(&new->changed, 0);
+    new->reading = 1;
+    new->closing = 0;
+    new->unanswered = 0;
+    new->failed = 0;
+    new->pending = malloc(CONNECTION_MAX_UNANSWERED * CONNECTION_MAX_RESPONSE);
+    new->pending_size = 0;
+    new->pending_count = 0;
+    new->writing = malloc(CONNECTION_MAX_UNANSWERED * CONNECTION_MAX_RESPONSE);
+    new->set = 0;
+    new->prev = 0;
+    new->next = 0;
+
+    return new;
+}
+
+/**
+ * @brief Release a reference to a connection, closing and freeing it once there are none left.
+ *
+ * @param c connection to release.
+ */
+void connection_release(Connection *c)
+{
+    if (atomic_fetch_sub(&c->references, 1) == 1)
+    {
+        // Leave the set before closing, so the server never shuts down a file descriptor that has been reused
+        Connection_Set *set = c->set;
+        if (set)
+        {
+            pthread_mutex_lock(&set->lock);
+            if (c->prev)
+                c->prev->next = c->next;
+            else
+                set->first = c->next;
+            if (c->next)
+                c->next->prev = c->prev;
+            set->open--;
+            pthread_cond_broadcast(&set->changed);
+            pthread_mutex_unlock(&set->lock);
+        }
+
+        if (!c->text)
+            close(c->in_fd);
+        pthread_mutex_destroy(&c->lock);
+        pthread_cond_destroy(&c->changed);
+        free(c->pending);
+        free(c->writing);
+        free(c);
+    }
+}
+
+/**
+ * @brief Wait until a connection has room for another request waiting for its response, and count the request.
+ *
+ * @param c connection the request was read from.
+ * @return 1 if the request can be queued, or 0 if responses can no longer be written to the connection or the server
+ * is stopping.
+ */
+int connection_begin_request(Connection *c)
+{
+    pthread_mutex_lock(&c->lock);
+    while (c->unanswered >= CONNECTION_MAX_UNANSWERED && !c->failed && !c->closing)
+        pthread_cond_wait(&c->changed, &c->lock);
+    const int res = !c->failed && !c->closing;
+    c->unanswered += res;
+    pthread_mutex_unlock(&c->lock);
+
+    return res;
+}
+
+/**
+ * @brief Mark a connection as no longer being read from, so its writer finishes once every request has been answered.
+ *
+ * @param c connection to mark.
+ */
+void connection_stop_reading(Connection *c)
+{
+    pthread_mutex_lock(&c->lock);
+    c->reading = 0;
+    pthread_cond_broadcast(&c->changed);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * @brief Add a response to the pending responses of a connection for its writer to write. Never waits for the client,
+ * and responses to a connection that can no longer be written to are dropped.
+ *
+ * @param c connection to respond to.
+ * @param label predicted label.
+ */
+void connection_respond(Connection *c, int label)
+{
+    pthread_mutex_lock(&c->lock);
+    if (!c->failed)
+    {
+        uint8_t *dest = c->pending + c->pending_size;
+        if (c->text)
+            c->pending_size += snprintf((char *)dest, CONNECTION_MAX_RESPONSE, "%i\n", label);
+        else
+        {
+            *dest = label;
+            c->pending_size++;
+        }
+        c->pending_count++;
+        pthread_cond_broadcast(&c->changed);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * @brief Read exactly a number of bytes from a file descriptor.
+ *
+ * @param fd file descriptor to read from.
+ * @param buffer place to store the bytes.
+ * @param size number of bytes to read.
+ * @return 1 if all the bytes were read, 0 at the end of the input or on an error.
+ */
+int read_exact(int fd, uint8_t *buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t res = read(fd, buffer + done, size - done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return 0;
+        done += res;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Write exactly a number of bytes to a file descriptor.
+ *
+ * @param fd file descriptor to write to.
+ * @param buffer bytes to write.
+ * @param size number of bytes to write.
+ * @return 1 if all the bytes were written, otherwise 0.
+ */
+int write_exact(int fd, const uint8_t *buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t res = write(fd, buffer + done, size - done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return 0;
+        done += res;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Entry point of a thread writing the responses of a connection as they are added. Finishes once the
+ * connection is no longer being read from and every request has been answered, or once a write fails.
+ *
+ * @param arg connection to write to, which the thread holds a reference to.
+ * @return nothing.
+ */
+void *writer_run(void *arg)
+{
+    Connection *c = arg;
+
+    pthread_mutex_lock(&c->lock);
+    while (1)
+    {
+        while (c->pending_count == 0 && (c->reading || c->unanswered > 0))
+            pthread_cond_wait(&c->changed, &c->lock);
+        if (c->pending_count == 0)
+            break;
+
+        // Take the pending responses, so the batching thread can add more while they are written
+        uint8_t *buffer = c->pending;
+        const int size = c->pending_size;
+        const int count = c->pending_count;
+        c->pending = c->writing;
+        c->writing = buffer;
+        c->pending_size = 0;
+        c->pending_count = 0;
+        pthread_mutex_unlock(&c->lock);
+
+        const int written = write_exact(c->out_fd, buffer, size);
+
+        pthread_mutex_lock(&c->lock);
+        c->unanswered -= count;
+        c->failed = !written;
+        pthread_cond_broadcast(&c->changed);
+        if (c->failed)
+            break;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    connection_release(c);
+
+    return 0;
+}
+
+/**
+ * @brief Start the writer thread of a connection.
+ *
+ * @param c connection to write to.
+ * @param thread place to store the writer thread.
+ * @return 0 if the thread was started, otherwise -1.
+ */
+int connection_start_writer(Connection *c, pthread_t *thread)
+{
+    atomic_fetch_add(&c->references, 1);
+    if (pthread_create(thread, 0, writer_run, c) != 0)
+    {
+        connection_release(c);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Initialize an empty set of connections.
+ *
+ * @param set set to initialize.
+ */
+void connection_set_init(Connection_Set *set)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&set->lock, 0);
+    pthread_cond_init(&set->changed, &attr);
+    pthread_condattr_destroy(&attr);
+
+    set->readers = 0;
+    set->open = 0;
+    set->first = 0;
+}
+
+/**
+ * @brief Add a connection that is about to start being read from to a set. It stays in the set until it is freed.
+ *
+ * @param set set to add to.
+ * @param c connection to add.
+ */
+void connection_set_add(Connection_Set *set, Connection *c)
+{
+    pthread_mutex_lock(&set->lock);
+    c->set = set;
+    c->next = set->first;
+    if (c->next)
+        c->next->prev = c;
+    set->first = c;
+    set->readers++;
+    set->open++;
+    pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * @brief Record that the reader thread of a connection in a set has finished.
+ *
+ * @param set set the connection is in.
+ */
+void connection_set_reader_done(Connection_Set *set)
+{
+    pthread_mutex_lock(&set->lock);
+    set->readers--;
+    pthread_cond_broadcast(&set->changed);
+    pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * @brief Stop reading from every connection in a set and wait for their reader threads to finish, so no more requests
+ * are queued.
+ *
+ * @param set set to stop reading from.
+ */
+void connection_set_stop_reading(Connection_Set *set)
+{
+    pthread_mutex_lock(&set->lock);
+    for (Connection *c = set->first; c; c = c->next)
+    {
+        pthread_mutex_lock(&c->lock);
+        c->closing = 1;
+        pthread_cond_broadcast(&c->changed);
+        pthread_mutex_unlock(&c->lock);
+        shutdown(c->in_fd, SHUT_RD);
+    }
+    while (set->readers > 0)
+        pthread_cond_wait(&set->changed, &set->lock);
+    pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * @brief Wait for every connection in a set to be freed, which happens once its responses have been written. After
+ * SERVER_CLOSE_TIMEOUT_MS the remaining connections are shut down, so clients that are not reading cannot keep the
+ * server from stopping.
+ *
+ * @param set set to wait for.
+ */
+void connection_set_wait(Connection_Set *set)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += (long)SERVER_CLOSE_TIMEOUT_MS * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock(&set->lock);
+    while (set->open > 0)
+    {
+        if (pthread_cond_timedwait(&set->changed, &set->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    for (Connection *c = set->first; c; c = c->next)
+        shutdown(c->out_fd, SHUT_RDWR);
+    while (set->open > 0)
+        pthread_cond_wait(&set->changed, &set->lock);
+    pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * @brief Frees a set of connections once they have all been freed.
+ *
+ * @param set set to free.
+ */
+void connection_set_free(Connection_Set *set)
+{
+    pthread_mutex_destroy(&set->lock);
+    pthread_cond_destroy(&set->changed);
+}
+
+/**
+ * @brief Initialize an empty request queue.
+ *
+ * @param q queue to initialize.
+ * @param image_size number of pixels in each request.
+ * @param capacity maximum number of queued requests.
+ */
+void queue_init(Request_Queue *q, int image_size, int capacity)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&q->lock, 0);
+    pthread_cond_init(&q->not_empty, &attr);
+    pthread_cond_init(&q->not_full, 0);
+    pthread_condattr_destroy(&attr);
+
+    q->image_size = image_size;
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->closed = 0;
+    q->pixels = malloc((size_t)image_size * capacity);
+    q->connections = malloc(sizeof(Connection *) * capacity);
+    q->arrivals = malloc(sizeof(struct timespec) * capacity);
+}
+
+/**
+ * @brief Frees memory used by a request queue.
+ *
+ * @param q queue to free memory of.
+ */
+void queue_free(Request_Queue *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->pixels);
+    free(q->connections);
+    free(q->arrivals);
+}
+
+/**
+ * @brief Add a request to a queue, waiting for space if it is full. The request holds a reference to the connection
+ * until it is responded to.
+ *
+ * @param q queue to add to.
+ * @param connection connection the request came from.
+ * @param pixels pixels of the request.
+ */
+void queue_push(Request_Queue *q, Connection *connection, const uint8_t *pixels)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+        pthread_cond_wait(&q->not_full, &q->lock);
+
+    int slot = (q->head + q->count) % q->capacity;
+    memcpy(q->pixels + (size_t)slot * q->image_size, pixels, q->image_size);
+    atomic_fetch_add(&connection->references, 1);
+    q->connections[slot] = connection;
+    clock_gettime(CLOCK_MONOTONIC, q->arrivals + slot);
+    q->count++;
+
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * @brief Mark a queue as closed, so the batching thread stops once it is empty.
+ *
+ * @param q queue to close.
+ */
+void queue_close(Request_Queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * @brief Entry point of a thread reading requests from a connection until it ends or its responses can no longer be
+ * written.
+ *
+ * @param arg reader to run.
+ * @return nothing.
+ */
+void *reader_run(void *arg)
+{
+    Reader *reader = arg;
+    Request_Queue *q = reader->queue;
+
+    uint8_t *pixels = malloc(q->image_size);
+    while (read_exact(reader->connection->in_fd, pixels, q->image_size) && connection_begin_request(reader->connection))
+        queue_push(q, reader->connection, pixels);
+    free(pixels);
+
+    // The set must be read before the connection is released, as that may free it
+    Connection_Set *set = reader->connection->set;
+    connection_stop_reading(reader->connection);
+    connection_release(reader->connection);
+    free(reader);
+    if (set)
+        connection_set_reader_done(set);
+
+    return 0;
+}
+
+/**
+ * @brief State shared with the batching thread.
+ */
+typedef struct
+{
+    Request_Queue *queue;
+    Neural_Net *network;
+    Server_Options *options;
+} Batcher;
+
+/**
+ * @brief Entry point of the batching thread. Waits for a batch of requests to be ready, runs them through the network
+ * and responds to each, until the queue is closed and empty.
+ *
+ * @param arg batcher to run.
+ * @return nothing.
+ */
+void *batcher_run(void *arg)
+{
+    Batcher *batcher = arg;
+    Request_Queue *q = batcher->queue;
+    const int max_batch = batcher->options->max_batch;
+
+    Predictor predictor = predictor_malloc(batcher->network, max_batch);
+    Matrix input = matrix_malloc(q->image_size, max_batch);
+    Connection **connections = malloc(sizeof(Connection *) * max_batch);
+    int *labels = malloc(sizeof(int) * max_batch);
+
+    while (1)
+    {
+        pthread_mutex_lock(&q->lock);
+        while (q->count == 0 && !q->closed)
+            pthread_cond_wait(&q->not_empty, &q->lock);
+
+        if (q->count == 0)
+        {
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+
+        // Wait for a full batch or until the oldest request has waited long enough
+        struct timespec deadline = q->arrivals[q->head];
+        deadline.tv_nsec += (long)batcher->options->max_wait_us * 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (q->count < max_batch && !q->closed)
+        {
+            if (pthread_cond_timedwait(&q->not_empty, &q->lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+
+        // Take the batch
+        const int count = MIN(q->count, max_batch);
+        input.height = count;
+        for (int n = 0; n < count; n++)
+        {
+            int slot = (q->head + n) % q->capacity;
+            Image image;
+            image.size = q->image_size;
+            image.data = q->pixels + (size_t)slot * q->image_size;
+            image_convert(input.values + n * input.width, &image);
+            connections[n] = q->connections[slot];
+        }
+        q->head = (q->head + count) % q->capacity;
+        q->count -= count;
+        pthread_cond_broadcast(&q->not_full);
+        pthread_mutex_unlock(&q->lock);
+
+        network_predict_batch(&predictor, &input, labels);
+
+        for (int n = 0; n < count; n++)
+        {
+            connection_respond(connections[n], labels[n]);
+            connection_release(connections[n]);
+        }
+    }
+
+    predictor_free(predictor);
+    matrix_free(input);
+    free(connections);
+    free(labels);
+
+    return 0;
+}
+
+/**
+ * @brief Serve predictions for images read from one file descriptor, writing each predicted label as a line of text
+ * to another. Returns once the input ends and every request has been responded to.
+ *
+ * @param network network to predict with.
+ * @param in_fd file descriptor to read images from.
+ * @param out_fd file descriptor to write labels to.
+ * @param options options to serve with.
+ * @return 0 on success, or 1 if the responses cannot be written or the batching thread cannot be started.
+ */
+int server_run_stream(Neural_Net *network, int in_fd, int out_fd, Server_Options *options)
+{
+    Connection *connection = connection_malloc(in_fd, out_fd, 1);
+    pthread_t writer_thread;
+    if (connection_start_writer(connection, &writer_thread) != 0)
+    {
+        connection_release(connection);
+        return 1;
+    }
+
+    Request_Queue queue;
+    queue_init(&queue, network->weights[0].width, options->queue_size);
+
+    Batcher batcher = {&queue, network, options};
+    pthread_t batcher_thread;
+    if (pthread_create(&batcher_thread, 0, batcher_run, &batcher) != 0)
+    {
+        connection_stop_reading(connection);
+        pthread_join(writer_thread, 0);
+        queue_free(&queue);
+        connection_release(connection);
+        return 1;
+    }
+
+    Reader *reader = malloc(sizeof(Reader));
+    reader->queue = &queue;
+    reader->connection = connection;
+    atomic_fetch_add(&connection->references, 1);
+    reader_run(reader);
+
+    queue_close(&queue);
+    pthread_join(batcher_thread, 0);
+    pthread_join(writer_thread, 0);
+    queue_free(&queue);
+
+    const int failed = connection->failed;
+    connection_release(connection);
+
+    return failed;
+}
+
+static int server_stop_fd = -1;
+
+/**
+ * @brief Signal handler asking a socket server to stop, by writing to the pipe its accept loop polls.
+ *
+ * @param signum signal received.
+ */
+void server_handle_stop(int signum)
+{
+    const uint8_t byte = signum;
+    if (write(server_stop_fd, &byte, 1) < 0)
+        return;
+}
+
+/**
+ * @brief Serve predictions to clients connecting to a Unix socket. Each connection is read by its own thread while a
+ * single thread runs batches through the network. Runs until the process receives SIGINT or SIGTERM, then answers the
+ * requests already read, closes the socket and returns.
+ *
+ * @param network network to predict with.
+ * @param path path of the socket to create.
+ * @param options options to serve with.
+ * @return 0 once the server has stopped, or 1 if the socket or the batching thread could not be created.
+ */
+int server_run_socket(Neural_Net *network, const char *path, Server_Options *options)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+        return 1;
+    strcpy(address.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        return 1;
+
+    unlink(path);
+    int stop_pipe[2];
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, 64) != 0 ||
+        pipe(stop_pipe) != 0)
+    {
+        close(listen_fd);
+        return 1;
+    }
+
+    Request_Queue queue;
+    queue_init(&queue, network->weights[0].width, options->queue_size);
+
+    Batcher batcher = {&queue, network, options};
+    pthread_t batcher_thread;
+    if (pthread_create(&batcher_thread, 0, batcher_run, &batcher) != 0)
+    {
+        queue_free(&queue);
+        close(listen_fd);
+        unlink(path);
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+        return 1;
+    }
+
+    // Clients disconnecting early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Stop signals may arrive on any thread, so they are passed to the accept loop through a pipe
+    server_stop_fd = stop_pipe[1];
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = server_handle_stop;
+    sigemptyset(&stop_action.sa_mask);
+    sigaction(SIGINT, &stop_action, 0);
+    sigaction(SIGTERM, &stop_action, 0);
+
+    Connection_Set set;
+    connection_set_init(&set);
+
+    while (1)
+    {
+        struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0)
+            continue;
+        if (fds[1].revents)
+            break;
+
+        int fd = accept(listen_fd, 0, 0);
+        if (fd < 0)
+            continue;
+
+        Reader *reader = malloc(sizeof(Reader));
+        reader->queue = &queue;
+        reader->connection = connection_malloc(fd, fd, 0);
+        connection_set_add(&set, reader->connection);
+
+        pthread_t reader_thread, writer_thread;
+        if (connection_start_writer(reader->connection, &writer_thread) != 0)
+        {
+            connection_release(reader->connection);
+            connection_set_reader_done(&set);
+            free(reader);
+            continue;
+        }
+        pthread_detach(writer_thread);
+
+        if (pthread_create(&reader_thread, 0, reader_run, reader) != 0)
+        {
+            connection_stop_reading(reader->connection);
+            connection_release(reader->connection);
+            connection_set_reader_done(&set);
+            free(reader);
+            continue;
+        }
+        pthread_detach(reader_thread);
+    }
+
+    // Stop taking requests, answer the ones already queued and wait for the responses to be written
+    close(listen_fd);
+    unlink(path);
+    connection_set_stop_reading(&set);
+    queue_close(&queue);
+    pthread_join(batcher_thread, 0);
+    connection_set_wait(&set);
+    connection_set_free(&set);
+    queue_free(&queue);
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    server_stop_fd = -1;
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+
+    return 0;
+}
+
+/**
+ * @brief State shared with the thread sending a dataset to a server.
+ */
+typedef struct
+{
+    int fd;
+    Dataset *dataset;
+    struct timespec *sent;
+} Sender;
+
+/**
+ * @brief Entry point of the thread sending every image of a dataset to a server.
+ *
+ * @param arg sender to run.
+ * @return nothing.
+ */
+void *sender_run(void *arg)
+{
+    Sender *sender = arg;
+    for (int i = 0; i < sender->dataset->count; i++)
+    {
+        const Image *image = dataset_image(sender->dataset, i);
+        clock_gettime(CLOCK_MONOTONIC, sender->sent + i);
+        if (!write_exact(sender->fd, image->data, image->size))
+            break;
+    }
+    shutdown(sender->fd, SHUT_WR);
+
+    return 0;
+}
+
+/**
+ * @brief Send every image of a dataset to a server and report the accuracy and latency percentiles of the responses.
+ * Images are sent by one thread while responses are read by another, so many requests are in flight at once.
+ *
+ * @param path path of the server's socket.
+ * @param dataset dataset to send.
+ * @return 0 on success, otherwise 1.
+ */
+int client_run(const char *path, Dataset *dataset)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+        return 1;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        printf("failed to connect to %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Sender sender = {fd, dataset, malloc(sizeof(struct timespec) * dataset->count)};
+    pthread_t sender_thread;
+    if (pthread_create(&sender_thread, 0, sender_run, &sender) != 0)
+    {
+        printf("failed to start sending to %s\n", path);
+        close(fd);
+        free(sender.sent);
+        return 1;
+    }
+
+    // The send times are only read once the sender has been joined, so arrival times are recorded until then
+    int received = 0, correct = 0;
+    struct timespec *arrived = malloc(sizeof(struct timespec) * MAX(1, dataset->count));
+    uint8_t label;
+    while (received < dataset->count && read_exact(fd, &label, 1))
+    {
+        clock_gettime(CLOCK_MONOTONIC, arrived + received);
+        correct += dataset_image(dataset, received)->label == label;
+        received++;
+    }
+
+    pthread_join(sender_thread, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(fd);
+
+    double latency_sum = 0;
+    double *latencies = malloc(sizeof(double) * MAX(1, received));
+    for (int i = 0; i < received; i++)
+    {
+        latencies[i] =
+            (arrived[i].tv_sec - sender.sent[i].tv_sec) + (arrived[i].tv_nsec - sender.sent[i].tv_nsec) * 1e-9;
+        latency_sum += latencies[i];
+    }
+    free(arrived);
+    free(sender.sent);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("Responses: %i out of %i\n", received, dataset->count);
+    printf("Accuracy: %i out of %i (%.2f%%)\n", correct, received, received ? 100.0 * correct / received : 0);
+    printf("Throughput: %.0f images/sec (%.3f s)\n", received / seconds, seconds);
+    if (received)
+    {
+        qsort(latencies, received, sizeof(double), compare_doubles);
+        printf("Latency: mean %.3f ms, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+               1000 * latency_sum / received, 1000 * latencies[received / 2], 1000 * latencies[received * 9 / 10],
+               1000 * latencies[received * 99 / 100], 1000 * latencies[received - 1]);
+    }
+    free(latencies);
+
+    return received == dataset->count ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,321 @@
+#include <stream.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+A stream reads the images of an IDX file pair in order from start to end, so that training only ever holds a fixed
+number of images in memory however large the files are. Each file is read in chunks of STREAM_CHUNK_SIZE bytes into a
+page aligned buffer, always at offsets that are a multiple of the chunk size, which keeps every read large and lets
+the kernel read ahead.
+
+Images come out of the stream through a shuffle buffer: the first buffer_capacity images of the files fill the buffer,
+then each image taken from the stream is picked at random from the buffer and its slot is refilled with the next image
+of the files. When the files run out the buffer is emptied in random order. A buffer at least as large as the files
+gives a full shuffle, and smaller buffers trade randomness for memory.
+*/
+
+#define STREAM_CHUNK_SIZE (4 << 20)
+#define STREAM_ALIGNMENT 4096
+#define IMAGE_MAGIC 2051
+#define LABEL_MAGIC 2049
+
+/**
+ * @brief Fill the buffer of a reader with the next chunk of its file.
+ *
+ * @param r reader to fill.
+ * @return 0 if any bytes were read, otherwise -1.
+ */
+int stream_reader_fill(Stream_Reader *r)
+{
+    size_t total = 0;
+    while (total < STREAM_CHUNK_SIZE)
+    {
+        ssize_t n = read(r->fd, r->buffer + total, STREAM_CHUNK_SIZE - total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        total += n;
+    }
+
+    r->position = 0;
+    r->end = total;
+
+    return total > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Move a reader back to the first byte after the header of its file.
+ *
+ * @param r reader to move.
+ * @return 0 if successful, otherwise -1.
+ */
+int stream_reader_rewind(Stream_Reader *r)
+{
+    if (lseek(r->fd, 0, SEEK_SET) != 0 || stream_reader_fill(r) != 0 || r->end < r->header_size)
+        return -1;
+
+    r->position = r->header_size;
+
+    return 0;
+}
+
+/**
+ * @brief Open a file for reading in chunks and read its header.
+ *
+ * @param r reader to open.
+ * @param file file to read.
+ * @param header_size size of the header at the start of the file.
+ * @return 0 if successful, otherwise -1. The header is at the start of the reader's buffer.
+ */
+int stream_reader_open(Stream_Reader *r, const char *file, size_t header_size)
+{
+    r->header_size = header_size;
+    r->buffer = aligned_alloc(STREAM_ALIGNMENT, STREAM_CHUNK_SIZE);
+    r->fd = open(file, O_RDONLY);
+    if (!r->buffer || r->fd < 0)
+        return -1;
+
+    posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    return stream_reader_rewind(r);
+}
+
+/**
+ * @brief Close the file of a reader and free its buffer.
+ *
+ * @param r reader to close.
+ */
+void stream_reader_close(Stream_Reader *r)
+{
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r->buffer);
+}
+
+/**
+ * @brief Copy the next bytes of a file, reading more chunks as needed.
+ *
+ * @param r reader to copy from.
+ * @param dest place to copy the bytes to.
+ * @param n number of bytes to copy.
+ * @return 0 if successful, otherwise -1.
+ */
+int stream_reader_read(Stream_Reader *r, uint8_t *dest, size_t n)
+{
+    while (n > 0)
+    {
+        if (r->position == r->end && stream_reader_fill(r) != 0)
+            return -1;
+
+        size_t available = r->end - r->position;
+        size_t copy = n < available ? n : available;
+        memcpy(dest, r->buffer + r->position, copy);
+        r->position += copy;
+        dest += copy;
+        n -= copy;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read the next image of the files into a slot of the shuffle buffer.
+ *
+ * @param s stream to read from.
+ * @param slot index of the slot to read into.
+ * @return 0 if successful, otherwise -1, including when the label is not below the stream's number of classes.
+ */
+int stream_read_slot(Image_Stream *s, int slot)
+{
+    if (stream_reader_read(&s->images, s->buffer_pixels + (size_t)slot * s->size, s->size) != 0 ||
+        stream_reader_read(&s->labels, s->buffer_labels + slot, 1) != 0 || s->buffer_labels[slot] >= s->classes)
+        return -1;
+
+    s->read++;
+
+    return 0;
+}
+
+/**
+ * @brief Open a pair of IDX files as a stream of images.
+ *
+ * @param image_file file that the image data is stored in.
+ * @param label_file file that the label data is stored in.
+ * @param buffer_capacity number of images in the shuffle buffer. It is limited to the number of images in the files.
+ * @return a new stream, or 0 if the files could not be opened. It must be rewound before images are read, and its
+ * number of classes set to the number of outputs of the network, as any label not below it is treated as an error.
+ */
+Image_Stream *stream_open(const char *image_file, const char *label_file, int buffer_capacity)
+{
+    const size_t IMAGE_HEADER_SIZE = 4 * sizeof(int32_t);
+    const size_t LABEL_HEADER_SIZE = 2 * sizeof(int32_t);
+
+    Image_Stream *s = calloc(1, sizeof(Image_Stream));
+    s->images.fd = -1;
+    s->labels.fd = -1;
+    if (buffer_capacity <= 0 || stream_reader_open(&s->images, image_file, IMAGE_HEADER_SIZE) != 0 ||
+        stream_reader_open(&s->labels, label_file, LABEL_HEADER_SIZE) != 0)
+        goto error;
+
+    // Read meta data
+    const uint8_t *image_header = s->images.buffer;
+    const uint8_t *label_header = s->labels.buffer;
+    if (image_read_header(image_header, 0) != IMAGE_MAGIC || image_read_header(label_header, 0) != LABEL_MAGIC)
+        goto error;
+
+    const int32_t rows = image_read_header(image_header, 2);
+    const int32_t cols = image_read_header(image_header, 3);
+    if (rows <= 0 || cols <= 0 || (int64_t)rows * cols > INT32_MAX)
+        goto error;
+
+    s->count = image_read_header(image_header, 1);
+    s->size = rows * cols;
+    if (s->count != image_read_header(label_header, 1) || s->count <= 0)
+        goto error;
+
+    s->buffer_capacity = buffer_capacity < s->count ? buffer_capacity : s->count;
+    s->buffer_pixels = malloc((size_t)s->buffer_capacity * s->size);
+    s->buffer_labels = malloc(s->buffer_capacity);
+    if (!s->buffer_pixels || !s->buffer_labels)
+        goto error;
+
+    return s;
+
+error:
+    stream_close(s);
+    return 0;
+}
+
+/**
+ * @brief Close the files of a stream and free it.
+ *
+ * @param s stream to close.
+ */
+void stream_close(Image_Stream *s)
+{
+    stream_reader_close(&s->images);
+    stream_reader_close(&s->labels);
+    free(s->buffer_pixels);
+    free(s->buffer_labels);
+    free(s);
+}
+
+/**
+ * @brief Move a stream back to the first image of its files and empty the shuffle buffer, ready for another pass.
+ *
+ * @param s stream to rewind.
+ * @param rng random number generator to split the generator for the pass's shuffle from.
+ * @return 0 if successful, otherwise -1.
+ */
+int stream_rewind(Image_Stream *s, Rng *rng)
+{
+    s->rng = rnd_split(rng);
+    s->read = 0;
+    s->buffer_count = 0;
+
+    if (stream_reader_rewind(&s->images) != 0 || stream_reader_rewind(&s->labels) != 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * @brief Take a random image from the shuffle buffer, refilling its slot from the files.
+ *
+ * @param s stream to take the image from.
+ * @param pixels place to copy the pixels of the image to.
+ * @param label place to store the label of the image.
+ * @return 1 if an image was taken, 0 if every image of the files has been taken since the stream was rewound, or -1
+ * if the files could not be read.
+ */
+int stream_next(Image_Stream *s, uint8_t *pixels, int *label)
+{
+    // Fill the buffer at the start of a pass
+    while (s->buffer_count < s->buffer_capacity && s->read < s->count)
+    {
+        if (stream_read_slot(s, s->buffer_count) != 0)
+            return -1;
+        s->buffer_count++;
+    }
+
+    if (s->buffer_count == 0)
+        return 0;
+
+    int slot = rnd_below(&s->rng, s->buffer_count);
+    memcpy(pixels, s->buffer_pixels + (size_t)slot * s->size, s->size);
+    *label = s->buffer_labels[slot];
+
+    if (s->read < s->count)
+        return stream_read_slot(s, slot) == 0 ? 1 : -1;
+
+    // Once the files run out, fill the hole with the last image in the buffer
+    s->buffer_count--;
+    memcpy(s->buffer_pixels + (size_t)slot * s->size, s->buffer_pixels + (size_t)s->buffer_count * s->size, s->size);
+    s->buffer_labels[slot] = s->buffer_labels[s->buffer_count];
+
+    return 1;
+}
+
+/**
+ * @brief Allocate a dataset to read images from a stream into. The dataset owns the pixels of its images.
+ *
+ * @param s stream the images will be read from.
+ * @param capacity greatest number of images that will be read at once.
+ * @return a new dataset with no images.
+ */
+Dataset *stream_dataset_malloc(Image_Stream *s, int capacity)
+{
+    Dataset *res = calloc(1, sizeof(Dataset));
+    res->images = malloc(sizeof(Image) * capacity);
+    res->pixels = malloc((size_t)capacity * s->size);
+
+    return res;
+}
+
+/**
+ * @brief Read the next images of a stream into a dataset, replacing any images it already had. If the stream is
+ * sparse, the nonzero pixels of the images are found as they are read.
+ *
+ * @param s stream to read from.
+ * @param dest dataset from stream_dataset_malloc to read into.
+ * @param count greatest number of images to read, which must not be more than the capacity of the dataset.
+ * @return number of images read, which is less than count at the end of a pass, or -1 if the files could not be read.
+ */
+int stream_read(Image_Stream *s, Dataset *dest, int count)
+{
+    int n = 0;
+    for (; n < count; n++)
+    {
+        Image *image = dest->images + n;
+        uint8_t *pixels = dest->pixels + (size_t)n * s->size;
+
+        int res = stream_next(s, pixels, &image->label);
+        if (res < 0)
+            return -1;
+        if (res == 0)
+            break;
+
+        image->size = s->size;
+        image->data = pixels;
+        image->nonzero_count = 0;
+        image->nonzero_indices = 0;
+        image->nonzero_values = 0;
+    }
+    dest->count = n;
+
+    if (s->sparse)
+    {
+        free(dest->sparse_indices);
+        free(dest->sparse_values);
+        dest->sparse_indices = 0;
+        dest->sparse_values = 0;
+        if (dataset_sparsify(dest) != 0)
+            return -1;
+    }
+
+    return n;
+}
\ No newline at end of file
@@ -0,0 +1,220 @@
+#include <topology.h>
+#include <layer.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+The generic forward pass sizes every loop at run time, so it suits any network. The topologies we deploy are fixed, so
+each one listed in TOPOLOGY_LIST also gets a forward pass generated with the width of every layer as a compile time
+constant. The compiler then unrolls the loops over a block of inputs and a layer's outputs, keeps the sums for the block
+in registers for the whole sweep over the layer's inputs, and every buffer is sized statically on the stack.
+
+Specialised passes read the weights packed by topology_pack: for each layer its biases, then its weights transposed so
+that the values for one input and all of the layer's outputs are next to each other. Both are padded with zeros to a
+multiple of TOPOLOGY_ALIGNMENT bytes, as are the node values of the hidden layers. The sums are made in a different
+order from the generic pass, so outputs can differ from it in the last bits.
+
+Layers are computed with the compiler's vector extensions. Like the kernels, each pass is compiled for several vector
+extensions, each with the vector size that suits it, and the best one the CPU supports is picked the first time a
+topology is looked up.
+*/
+
+#define TOPOLOGY_BLOCK 4
+#define TOPOLOGY_MAX_WIDTH 32
+#define TOPOLOGY_ALIGNMENT 64
+#define TOPOLOGY_PAD ((int)(TOPOLOGY_ALIGNMENT / sizeof(real)))
+#define TOPOLOGY_PADDED(n) (((n) + TOPOLOGY_PAD - 1) / TOPOLOGY_PAD * TOPOLOGY_PAD)
+
+// Name, then the number of inputs and the width of each layer
+#define TOPOLOGY_LIST(X) X(mnist_16_16, 784, 16, 16, 10)
+
+/*
+TOPOLOGY_DEFINE_VECTOR(BYTES) defines the building blocks of the passes for vectors of BYTES bytes. Both functions are
+always inlined, so that the sizes and rows are constants wherever they are used.
+
+topology_layer_BYTES(dest, input, stride, packed, in, out, rows) runs a layer on a block of rows inputs, with stride
+values between rows of input, storing TOPOLOGY_PADDED(out) raw node values per input in dest. packed holds the biases
+and transposed weights of the layer.
+
+topology_forward3_BYTES(dest, packed, input, s0, s1, s2, s3, rows, softmax) runs a network with s0 inputs and layers
+of s1, s2 and s3 nodes on a block of rows inputs, storing s3 outputs per input in dest.
+*/
+#define TOPOLOGY_DEFINE_VECTOR(BYTES)                                                                                  \
+    typedef real Topology_Vector_##BYTES __attribute__((vector_size(BYTES)));                                          \
+                                                                                                                       \
+    static inline __attribute__((always_inline)) void topology_layer_##BYTES(                                          \
+        real *dest, const real *input, int stride, const real *packed, int in, int out, int rows)                      \
+    {                                                                                                                  \
+        typedef Topology_Vector_##BYTES Vec;                                                                           \
+        const int vectors = TOPOLOGY_PADDED(out) * (int)sizeof(real) / BYTES;                                          \
+        const Vec *biases = (const Vec *)packed;                                                                       \
+        const Vec *weights = biases + vectors;                                                                         \
+        /* Smaller blocks split the inputs between several sums per row, so there are always TOPOLOGY_BLOCK chains */  \
+        const int chains = TOPOLOGY_BLOCK / rows;                                                                      \
+        Vec z[TOPOLOGY_BLOCK][TOPOLOGY_PADDED(TOPOLOGY_MAX_WIDTH) * sizeof(real) / BYTES];                             \
+                                                                                                                       \
+        for (int c = 0; c < TOPOLOGY_BLOCK; c++)                                                                       \
+            for (int v = 0; v < vectors; v++)                                                                          \
+                z[c][v] = c < rows ? biases[v] : (Vec){0};                                                             \
+                                                                                                                       \
+        int k = 0;                                                                                                     \
+        for (; k + chains <= in; k += chains)                                                                          \
+        {                                                                                                              \
+            _Pragma("GCC unroll 4") for (int c = 0; c < TOPOLOGY_BLOCK; c++)                                           \
+            {                                                                                                          \
+                const real x = input[(c % rows) * stride + k + c / rows];                                              \
+                const Vec *w = weights + (k + c / rows) * vectors;                                                     \
+                _Pragma("GCC unroll 16") for (int v = 0; v < vectors; v++) z[c][v] += x * w[v];                        \
+            }                                                                                                          \
+        }                                                                                                              \
+        for (; k < in; k++)                                                                                            \
+            for (int r = 0; r < rows; r++)                                                                             \
+                for (int v = 0; v < vectors; v++)                                                                      \
+                    z[r][v] += input[r * stride + k] * weights[k * vectors + v];                                       \
+                                                                                                                       \
+        for (int c = rows; c < TOPOLOGY_BLOCK; c++)                                                                    \
+            for (int v = 0; v < vectors; v++)                                                                          \
+                z[c % rows][v] += z[c][v];                                                                             \
+        for (int r = 0; r < rows; r++)                                                                                 \
+            for (int v = 0; v < vectors; v++)                                                                          \
+                ((Vec *)dest)[r * vectors + v] = z[r][v];                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+                                                                                                                       \
+    static inline __attribute__((always_inline)) void topology_forward3_##BYTES(                                       \
+        real *dest, const real *packed, const real *input, int s0, int s1, int s2, int s3, int rows, int softmax)      \
+    {                                                                                                                  \
+        const int p1 = TOPOLOGY_PADDED(s1), p2 = TOPOLOGY_PADDED(s2), p3 = TOPOLOGY_PADDED(s3);                        \
+        real a1[TOPOLOGY_BLOCK * TOPOLOGY_PADDED(TOPOLOGY_MAX_WIDTH)] __attribute__((aligned(TOPOLOGY_ALIGNMENT)));     \
+        real a2[TOPOLOGY_BLOCK * TOPOLOGY_PADDED(TOPOLOGY_MAX_WIDTH)] __attribute__((aligned(TOPOLOGY_ALIGNMENT)));     \
+        real a3[TOPOLOGY_BLOCK * TOPOLOGY_PADDED(TOPOLOGY_MAX_WIDTH)] __attribute__((aligned(TOPOLOGY_ALIGNMENT)));     \
+                                                                                                                       \
+        topology_layer_##BYTES(a1, input, s0, packed, s0, s1, rows);                                                   \
+        layer_activate_rows(a1, a1, rows, p1, 0);                                                                      \
+        packed += p1 + s0 * p1;                                                                                        \
+                                                                                                                       \
+        topology_layer_##BYTES(a2, a1, p1, packed, s1, s2, rows);                                                      \
+        layer_activate_rows(a2, a2, rows, p2, 0);                                                                      \
+        packed += p2 + s1 * p2;                                                                                        \
+                                                                                                                       \
+        /* Drop the padding of the output layer before its activation function, which may be softmax */                \
+        topology_layer_##BYTES(a3, a2, p2, packed, s2, s3, rows);                                                      \
+        for (int r = 0; r < rows; r++)                                                                                 \
+            for (int m = 0; m < s3; m++)                                                                               \
+                dest[r * s3 + m] = a3[r * p3 + m];                                                                     \
+        layer_activate_rows(dest, dest, rows, s3, softmax);                                                            \
+    }
+
+TOPOLOGY_DEFINE_VECTOR(16)
+TOPOLOGY_DEFINE_VECTOR(32)
+TOPOLOGY_DEFINE_VECTOR(64)
+
+// Forward pass of one topology for one set of vector extensions, in blocks of TOPOLOGY_BLOCK inputs
+#define TOPOLOGY_DEFINE_RUN(NAME, SUFFIX, TARGET, BYTES, S0, S1, S2, S3)                                               \
+    TARGET void topology_run_##NAME##_##SUFFIX(real *dest, const real *packed, const real *input, int rows,           \
+                                                int softmax)                                                           \
+    {                                                                                                                  \
+        int n = 0;                                                                                                     \
+        for (; n + TOPOLOGY_BLOCK <= rows; n += TOPOLOGY_BLOCK)                                                        \
+            topology_forward3_##BYTES(dest + n * S3, packed, input + n * S0, S0, S1, S2, S3, TOPOLOGY_BLOCK, softmax); \
+        for (; n < rows; n++)                                                                                          \
+            topology_forward3_##BYTES(dest + n * S3, packed, input + n * S0, S0, S1, S2, S3, 1, softmax);              \
+    }
+
+#define TOPOLOGY_DEFINE(NAME, S0, S1, S2, S3)                                                                          \
+    _Static_assert(S1 <= TOPOLOGY_MAX_WIDTH && S2 <= TOPOLOGY_MAX_WIDTH && S3 <= TOPOLOGY_MAX_WIDTH,                   \
+                   "layer of " #NAME " is too wide to specialise");                                                   \
+    TOPOLOGY_DEFINE_RUN(NAME, scalar, , 16, S0, S1, S2, S3)                                                            \
+    TOPOLOGY_DEFINE_RUN(NAME, avx2, __attribute__((target("avx2,fma"))), 32, S0, S1, S2, S3)                           \
+    TOPOLOGY_DEFINE_RUN(NAME, avx512, __attribute__((target("avx512f"))), 64, S0, S1, S2, S3)                          \
+    static const int topology_sizes_##NAME[] = {S0, S1, S2, S3};
+
+TOPOLOGY_LIST(TOPOLOGY_DEFINE)
+
+#define TOPOLOGY_ENTRY(NAME, S0, S1, S2, S3) {#NAME, 3, topology_sizes_##NAME, topology_run_##NAME##_scalar},
+
+static Topology topology_table[] = {TOPOLOGY_LIST(TOPOLOGY_ENTRY)};
+
+static const int TOPOLOGY_COUNT = sizeof(topology_table) / sizeof(topology_table[0]);
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+#define TOPOLOGY_SELECT(NAME, S0, S1, S2, S3)                                                                          \
+    if (__builtin_cpu_supports("avx512f"))                                                                             \
+        t->run = topology_run_##NAME##_avx512;                                                                         \
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))                                          \
+        t->run = topology_run_##NAME##_avx2;                                                                           \
+    t++;
+
+/**
+ * @brief Point every topology at the best version of its forward pass for the CPU.
+ */
+void topology_select()
+{
+    __builtin_cpu_init();
+
+    Topology *t = topology_table;
+    TOPOLOGY_LIST(TOPOLOGY_SELECT)
+}
+
+/**
+ * @brief Find the specialised topology matching a network.
+ *
+ * @param network network to match.
+ * @return the matching topology, or 0 if the network must be run with the generic forward pass.
+ */
+const Topology *topology_find(Neural_Net *network)
+{
+    pthread_once(&topology_once, topology_select);
+
+    for (int i = 0; i < TOPOLOGY_COUNT; i++)
+    {
+        const Topology *t = topology_table + i;
+        if (t->layers != network->layers || t->sizes[0] != network->weights[0].width)
+            continue;
+
+        int match = 1;
+        for (int l = 0; l < network->layers; l++)
+            match &= t->sizes[l + 1] == network->biases[l].size;
+        if (match)
+            return t;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Pack the biases and weights of a network for its specialised forward pass. The packed values are a copy, so
+ * they must be packed again after the network changes.
+ *
+ * @param topology topology of the network, from topology_find.
+ * @param network network to pack.
+ * @return packed values, which must be freed with free, or 0 if memory could not be allocated.
+ */
+real *topology_pack(const Topology *topology, Neural_Net *network)
+{
+    size_t size = 0;
+    for (int l = 0; l < topology->layers; l++)
+        size += (size_t)(1 + topology->sizes[l]) * TOPOLOGY_PADDED(topology->sizes[l + 1]);
+
+    real *res = aligned_alloc(TOPOLOGY_ALIGNMENT, sizeof(real) * size);
+    if (!res)
+        return 0;
+
+    real *dest = res;
+    for (int l = 0; l < topology->layers; l++)
+    {
+        const int in = topology->sizes[l];
+        const int out = topology->sizes[l + 1];
+        const int padded = TOPOLOGY_PADDED(out);
+        Matrix *weights = network->weights + l;
+
+        for (int m = 0; m < padded; m++)
+            *dest++ = m < out ? network->biases[l].values[m] : 0;
+        for (int k = 0; k < in; k++)
+            for (int m = 0; m < padded; m++)
+                *dest++ = m < out ? weights->values[m * in + k] : 0;
+    }
+
+    return res;
+}
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <string_ext.h>
 #include <stdio.h>
+#include <kernel.h>
 
 /**
  * @brief Creates a vector that represents an error.
@@ -17,6 +18,8 @@ Vector vector_error()
     Vector err;
     err.size = -1;
     err.values = 0;
+
+    return err;
 }
 
 /**
@@ -35,7 +38,7 @@ Vector vector_malloc(int size)
     Vector new;
 
     new.size = size;
-    new.values = malloc(sizeof(double) * size);
+    new.values = malloc(sizeof(real) * size);
 
     return new;
 }
@@ -56,7 +59,7 @@ Vector vector_calloc(int size)
     Vector new;
 
     new.size = size;
-    new.values = calloc(size, sizeof(double));
+    new.values = calloc(size, sizeof(real));
 
     return new;
 }
@@ -116,7 +119,7 @@ char *vector_to_string(const Vector v)
  * @param v vector to fill.
  * @param values values to put in vector.
  */
-void vector_fill(Vector *v, double *values)
+void vector_fill(Vector *v, real *values)
 {
     for (int i = 0; i < v->size; i++)
         v->values[i] = values[i];
@@ -137,12 +140,12 @@ void vector_fill_zero(Vector *v)
  * @brief Initialize a vector with random values sampled from a normal distribution;
  *
  * @param v vector to initialize.
+ * @param rng random number generator to sample with.
  * @param std_dev standard deviation of normal distribution to sample.
  */
-void vector_fill_normal(Vector *v, double std_dev)
+void vector_fill_normal(Vector *v, Rng *rng, double std_dev)
 {
-    for (int i = 0; i < v->size; i++)
-        v->values[i] = rnd_normal(std_dev);
+    rnd_fill_normal(rng, v->values, v->size, std_dev);
 }
 
 /**
@@ -209,6 +212,27 @@ Vector *vector_add(Vector *dest, Vector *v)
     return dest;
 }
 
+/**
+ * @brief Add a scaled vector to another vector (dest += scale * v).
+ *
+ * @param dest vector to add to and store result in.
+ * @param scale value to multiply v by.
+ * @param v vector to scale and add.
+ * @return vector result.
+ */
+Vector *vector_axpy(Vector *dest, real scale, Vector *v)
+{
+    if (dest->size != v->size)
+    {
+        *dest = vector_error();
+        return dest;
+    }
+
+    kernel_axpy(dest->values, scale, v->values, dest->size);
+
+    return dest;
+}
+
 /**
  * @brief Calculate the magnitude of a vector.
  *
@@ -277,7 +301,7 @@ double vector_sq_diff_sum(Vector *a, Vector *b)
 int vector_max_index(Vector *v)
 {
     int index = 0;
-    double max = v->values[0];
+    real max = v->values[0];
     for (int i = 1; i < v->size; i++)
     {
         if (v->values[i] > max)
@@ -307,13 +331,7 @@ Vector *vector_matrix_mult(Vector *dest, Vector *v, Matrix *m)
     }
 
     for (int i = 0; i < m->height; i++)
-    {
-        dest->values[i] = 0;
-        for (int j = 0; j < m->width; j++)
-        {
-            dest->values[i] += m->values[i * m->width + j] * v->values[j];
-        }
-    }
+        dest->values[i] = kernel_dot(m->values + i * m->width, v->values, m->width);
 
     return dest;
 }
@@ -326,6 +344,144 @@ Vector *vector_matrix_mult(Vector *dest, Vector *v, Matrix *m)
  */
 Vector *vector_sigmoid(Vector *v)
 {
+    kernel_sigmoid(v->values, v->values, v->size);
+
+    return v;
+}
+
+/**
+ * @brief Create a vector that refers to a single row of a matrix. The vector shares memory with the matrix so must not
+ * be freed.
+ *
+ * @param m matrix to take the row from.
+ * @param row index of the row.
+ * @return a vector referring to the row.
+ */
+Vector vector_view_row(Matrix *m, int row)
+{
+    Vector view;
+    view.size = m->width;
+    view.values = m->values + row * m->width;
+
+    return view;
+}
+
+/**
+ * @brief Create a vector that refers to all the values of a matrix. The vector shares memory with the matrix so must
+ * not be freed.
+ *
+ * @param m matrix to refer to.
+ * @return a vector referring to the values of the matrix.
+ */
+Vector vector_view_matrix(Matrix *m)
+{
+    Vector view;
+    view.size = m->width * m->height;
+    view.values = m->values;
+
+    return view;
+}
+
+/**
+ * @brief Add every row of a matrix to a vector.
+ *
+ * @param dest vector to add to and store result in.
+ * @param m matrix with rows to add.
+ * @return vector result.
+ */
+Vector *vector_add_matrix_rows(Vector *dest, Matrix *m)
+{
+    if (dest->size != m->width)
+    {
+        *dest = vector_error();
+        return dest;
+    }
+
+    for (int n = 0; n < m->height; n++)
+    {
+        real *row = m->values + n * m->width;
+        for (int i = 0; i < m->width; i++)
+            dest->values[i] += row[i];
+    }
+
+    return dest;
+}
+
+/**
+ * @brief Add the outer product of a sparse vector and a vector to a matrix (dest += v * u^T), only changing the rows
+ * for the nonzero values of the sparse vector.
+ *
+ * @param dest matrix to add to and store result in.
+ * @param v sparse vector giving the rows to add to.
+ * @param u vector to add to each row.
+ * @return matrix result.
+ */
+Matrix *matrix_add_sparse_outer(Matrix *dest, Sparse_Vector *v, Vector *u)
+{
+    if (dest->width != u->size)
+    {
+        *dest = matrix_error();
+        return dest;
+    }
+
+    kernel_scatter_axpy(dest->values, dest->width, v->indices, v->values, v->count, u->values);
+
+    return dest;
+}
+
+/**
+ * @brief Apply the softmax function to a vector. The largest value is subtracted before taking exponentials so that
+ * they cannot overflow.
+ *
+ * @param v vector to apply softmax function to.
+ * @return vector result.
+ */
+Vector *vector_softmax(Vector *v)
+{
+    real max = v->values[0];
+    for (int i = 1; i < v->size; i++)
+        max = MAX(max, v->values[i]);
+
+    real sum = 0;
+    for (int i = 0; i < v->size; i++)
+    {
+        v->values[i] = REAL_EXP(v->values[i] - max);
+        sum += v->values[i];
+    }
+
+    const real scale = 1 / sum;
     for (int i = 0; i < v->size; i++)
-        v->values[i] = sigmoid(v->values[i]);
+        v->values[i] *= scale;
+
+    return v;
+}
+
+/**
+ * @brief Calculate the cross-entropy between an expected distribution and the softmax of some values. The cost is
+ * found from the values before softmax is applied, as log(sum(exp(z))) - z_i, which stays finite even where the softmax
+ * rounds to 0.
+ *
+ * @param z values before softmax is applied.
+ * @param y expected distribution.
+ * @return cross-entropy, or -1 if the sizes do not match.
+ */
+double vector_softmax_cross_entropy(Vector *z, Vector *y)
+{
+    if (z->size != y->size)
+        return -1;
+
+    real max = z->values[0];
+    for (int i = 1; i < z->size; i++)
+        max = MAX(max, z->values[i]);
+
+    double sum = 0;
+    for (int i = 0; i < z->size; i++)
+        sum += exp(z->values[i] - max);
+    const double log_sum = max + log(sum);
+
+    double cost = 0;
+    for (int i = 0; i < z->size; i++)
+        cost += y->values[i] * (log_sum - z->values[i]);
+
+    return cost;
 }
\ No newline at end of file
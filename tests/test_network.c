@@ -0,0 +1,680 @@
+#include <neural_net.h>
+#include <backpropagation.h>
+#include <predict.h>
+#include <layer.h>
+#include <kernel.h>
+#include <random.h>
+#include <math_ext.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/*
+Regression checks for the parts of training and inference that have been rewritten for speed, each compared with a
+simpler way of getting the same answer:
+    gradient: backpropagation, for one input and for a batch, against finite differences of the cost, with a sigmoid
+        output and the squared error and with a softmax output and the cross-entropy
+    topology: the specialised forward pass of a fixed topology against the generic forward pass
+    optimizer: two steps of momentum, Nesterov and Adam against values worked out by hand
+    model: a network saved with network_save and loaded back with network_load
+    deterministic: two training runs in deterministic mode with the same seed and number of threads
+    sparse: training on a sparsified dataset against training on the same dataset kept dense
+    stream: the images read from a stream in each pass against the images of the same files loaded whole
+
+Build and run from the root of the repository, once for each precision:
+    gcc -O2 -Wall -pthread -Iinclude tests/test_network.c $(find src -name '*.c' ! -name main.c) -lm -o test_network
+    ./test_network
+Add -DSINGLE_PRECISION to check the float build. The exit code is the number of failed checks.
+*/
+
+#ifdef SINGLE_PRECISION
+#define TEST_STEP 1e-2
+#define TEST_GRADIENT_TOLERANCE 2e-2
+#define TEST_FORWARD_TOLERANCE 1e-5
+#define TEST_OPTIMIZER_TOLERANCE 1e-5
+#else
+#define TEST_STEP 1e-6
+#define TEST_GRADIENT_TOLERANCE 1e-6
+#define TEST_FORWARD_TOLERANCE 1e-12
+#define TEST_OPTIMIZER_TOLERANCE 1e-12
+#endif
+
+#define TEST_SEED 7
+#define TEST_IMAGE_SIDE 8
+#define TEST_CLASSES 10
+#define TEST_DATASET_COUNT 2000
+
+/**
+ * @brief Print the result of a check.
+ *
+ * @param name name of the check.
+ * @param error largest error found.
+ * @param tolerance largest error allowed.
+ * @return 0 if the check passed, otherwise 1.
+ */
+int test_report(const char *name, double error, double tolerance)
+{
+    const int failed = !(error <= tolerance);
+    printf("%s %s (error %.3g, tolerance %.3g)\n", failed ? "FAIL" : "PASS", name, error, tolerance);
+
+    return failed;
+}
+
+/**
+ * @brief Create a network with random values.
+ *
+ * @param layers number of layers, counting the input as in network_malloc.
+ * @param sizes number of inputs followed by the width of each layer.
+ * @param output kind of output layer.
+ * @param rng random number generator to fill the network with.
+ * @return a new network.
+ */
+Neural_Net test_network_malloc(int layers, int *sizes, Output_Type output, Rng *rng)
+{
+    Neural_Net network = network_malloc(layers, sizes);
+    network.output = output;
+    network_initialize(&network, rng, 1);
+
+    return network;
+}
+
+/**
+ * @brief Write a dataset of random images to a pair of new IDX files. Most pixels are 0, as in MNIST.
+ *
+ * @param image_file template for the name of the image file, as for mkstemp, which is replaced by the name.
+ * @param label_file template for the name of the label file, as for mkstemp, which is replaced by the name.
+ * @param count number of images.
+ * @param rng random number generator to make the images with.
+ * @return 0 on success, otherwise -1. Any files created are removed on failure.
+ */
+int test_write_dataset(char *image_file, char *label_file, int count, Rng *rng)
+{
+    int img_fd = mkstemp(image_file);
+    int lbl_fd = mkstemp(label_file);
+    FILE *img_f = img_fd >= 0 ? fdopen(img_fd, "wb") : 0;
+    FILE *lbl_f = lbl_fd >= 0 ? fdopen(lbl_fd, "wb") : 0;
+
+    int ok = img_f && lbl_f;
+    if (ok)
+    {
+        int32_t img_header[4] = {htonl(2051), htonl(count), htonl(TEST_IMAGE_SIDE), htonl(TEST_IMAGE_SIDE)};
+        int32_t lbl_header[2] = {htonl(2049), htonl(count)};
+        ok = fwrite(img_header, sizeof(int32_t), 4, img_f) == 4 && fwrite(lbl_header, sizeof(int32_t), 2, lbl_f) == 2;
+
+        uint8_t pixels[TEST_IMAGE_SIDE * TEST_IMAGE_SIDE];
+        for (int i = 0; ok && i < count; i++)
+        {
+            for (int j = 0; j < TEST_IMAGE_SIDE * TEST_IMAGE_SIDE; j++)
+                pixels[j] = rnd_double(rng) < 0.3 ? rnd_below(rng, 256) : 0;
+            uint8_t label = rnd_below(rng, TEST_CLASSES);
+            ok = fwrite(pixels, 1, sizeof(pixels), img_f) == sizeof(pixels) && fwrite(&label, 1, 1, lbl_f) == 1;
+        }
+    }
+
+    if (img_f)
+        ok = fclose(img_f) == 0 && ok;
+    else if (img_fd >= 0)
+        close(img_fd);
+    if (lbl_f)
+        ok = fclose(lbl_f) == 0 && ok;
+    else if (lbl_fd >= 0)
+        close(lbl_fd);
+
+    if (!ok)
+    {
+        if (img_fd >= 0)
+            unlink(image_file);
+        if (lbl_fd >= 0)
+            unlink(label_file);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Create a dataset of random images by writing it to temporary IDX files and loading them.
+ *
+ * @param count number of images.
+ * @param rng random number generator to make the images with.
+ * @return the dataset, or 0 if it could not be written or loaded.
+ */
+Dataset *test_dataset_malloc(int count, Rng *rng)
+{
+    char images[] = "/tmp/test_network_images_XXXXXX";
+    char labels[] = "/tmp/test_network_labels_XXXXXX";
+    if (test_write_dataset(images, labels, count, rng) != 0)
+        return 0;
+
+    Dataset *dataset = image_load(images, labels);
+    unlink(images);
+    unlink(labels);
+
+    return dataset;
+}
+
+/**
+ * @brief Calculate the cost of a network for a batch of inputs from its output, without the raw node values the
+ * training code uses.
+ *
+ * @param predictor predictor for the network.
+ * @param input inputs, one row per input.
+ * @param labels expected label of each input.
+ * @return cost summed over the inputs.
+ */
+double test_cost(Predictor *predictor, Matrix *input, const int *labels)
+{
+    Matrix *output = network_predict_batch(predictor, input, 0);
+
+    double cost = 0;
+    for (int n = 0; n < output->height; n++)
+    {
+        const real *row = output->values + n * output->width;
+        for (int i = 0; i < output->width; i++)
+        {
+            if (predictor->network->output == OUTPUT_SOFTMAX)
+                cost -= i == labels[n] ? log(row[i]) : 0;
+            else
+                cost += (row[i] - (i == labels[n])) * (row[i] - (i == labels[n]));
+        }
+    }
+
+    return cost;
+}
+
+/**
+ * @brief Compare the gradient from backpropagation with central differences of the cost, both for each input on its
+ * own and for all the inputs as one batch.
+ *
+ * @param output kind of output layer.
+ * @param name name of the check.
+ * @return number of failed checks.
+ */
+int test_gradient(Output_Type output, const char *name)
+{
+    // Wide enough for whole vectors and more than one block of columns, with batch and layer sizes that leave rows
+    // over after the blocks of the backward pass
+    const int BATCH = 6;
+    int sizes[4] = {70, 20, 6, 3};
+    const int layers = 3;
+
+    Rng rng = rnd_create(TEST_SEED);
+    Neural_Net network = test_network_malloc(layers + 1, sizes, output, &rng);
+    Predictor predictor = predictor_malloc(&network, BATCH);
+
+    Matrix input = matrix_malloc(sizes[0], BATCH);
+    Matrix expected = matrix_malloc(sizes[layers], BATCH);
+    int labels[BATCH];
+    Vector all_expected = vector_view_matrix(&expected);
+    vector_fill_zero(&all_expected);
+    for (int n = 0; n < BATCH; n++)
+    {
+        rnd_fill_normal(&rng, input.values + n * input.width, input.width, 1);
+        labels[n] = rnd_below(&rng, sizes[layers]);
+        expected.values[n * expected.width + labels[n]] = 1;
+    }
+
+    // Run the network forward, keeping the node values of every layer with the inputs in node_values[-1]
+    Matrix *node_values = malloc(sizeof(Matrix) * (layers + 1));
+    node_values = node_values + 1;
+    node_values[-1] = input;
+    for (int i = 0; i < layers; i++)
+    {
+        node_values[i] = matrix_malloc(sizes[i + 1], BATCH);
+        layer_forward(0, node_values + i, node_values + (i - 1), network.weights + i, network.biases + i,
+                      i == layers - 1 && output == OUTPUT_SOFTMAX);
+    }
+
+    // Sum the gradients of each input on its own, using one row of every matrix
+    Backprop_Workspace workspace = backprop_workspace_malloc(&network, BATCH);
+    Vector gradient = vector_calloc(network.total_values);
+    Vector *row_values = malloc(sizeof(Vector) * (layers + 1));
+    row_values = row_values + 1;
+    for (int n = 0; n < BATCH; n++)
+    {
+        for (int i = -1; i < layers; i++)
+            row_values[i] = vector_view_row(node_values + i, n);
+        Vector expected_row = vector_view_row(&expected, n);
+        backprop_calc_grad(&gradient, &workspace, &network, row_values, &expected_row, 0, 0);
+    }
+
+    Vector batch_gradient = vector_calloc(network.total_values);
+    backprop_calc_grad_batch(&batch_gradient, &workspace, &network, node_values, &expected, 0, 0);
+
+    // Move each value of the network either way and see how the cost changes
+    double gradient_error = 0, batch_error = 0;
+    for (int k = 0; k < network.total_values; k++)
+    {
+        const real value = network.values[k];
+        network.values[k] = value + TEST_STEP;
+        const double above = test_cost(&predictor, &input, labels);
+        network.values[k] = value - TEST_STEP;
+        const double below = test_cost(&predictor, &input, labels);
+        network.values[k] = value;
+
+        const double numeric = (above - below) / (2 * TEST_STEP);
+        const double scale = MAX(1, fabs(numeric));
+        gradient_error = MAX(gradient_error, fabs(gradient.values[k] - numeric) / scale);
+        batch_error = MAX(batch_error, fabs(batch_gradient.values[k] - numeric) / scale);
+    }
+
+    char check[64];
+    snprintf(check, sizeof(check), "gradient %s per input", name);
+    int failed = test_report(check, gradient_error, TEST_GRADIENT_TOLERANCE);
+    snprintf(check, sizeof(check), "gradient %s batch", name);
+    failed += test_report(check, batch_error, TEST_GRADIENT_TOLERANCE);
+
+    // Free values
+    for (int i = 0; i < layers; i++)
+        matrix_free(node_values[i]);
+    free(node_values - 1);
+    free(row_values - 1);
+    vector_free(gradient);
+    vector_free(batch_gradient);
+    backprop_workspace_free(workspace);
+    matrix_free(input);
+    matrix_free(expected);
+    predictor_free(predictor);
+    network_free(network);
+
+    return failed;
+}
+
+/**
+ * @brief Compare the specialised forward pass of the fixed MNIST topology with the generic forward pass, for batch
+ * sizes that do and do not fill its blocks of inputs.
+ *
+ * @param output kind of output layer.
+ * @param name name of the check.
+ * @return number of failed checks.
+ */
+int test_topology(Output_Type output, const char *name)
+{
+    const int MAX_BATCH = 9;
+    int sizes[4] = {784, 16, 16, 10};
+
+    Rng rng = rnd_create(TEST_SEED);
+    Neural_Net network = test_network_malloc(4, sizes, output, &rng);
+
+    Predictor specialised = predictor_malloc(&network, MAX_BATCH);
+    Predictor generic = predictor_malloc(&network, MAX_BATCH);
+    generic.topology = 0;
+
+    char check[64];
+    snprintf(check, sizeof(check), "topology %s", name);
+    if (!specialised.topology)
+    {
+        printf("FAIL %s (no specialised forward pass for 784-16-16-10)\n", check);
+        predictor_free(specialised);
+        predictor_free(generic);
+        network_free(network);
+        return 1;
+    }
+
+    // Pixel values in [0, 1], as from image_convert
+    Matrix input = matrix_malloc(sizes[0], MAX_BATCH);
+    for (int i = 0; i < input.width * input.height; i++)
+        input.values[i] = rnd_double(&rng);
+
+    double error = 0;
+    for (int batch = 1; batch <= MAX_BATCH; batch++)
+    {
+        input.height = batch;
+        int specialised_labels[MAX_BATCH], generic_labels[MAX_BATCH];
+        Matrix *a = network_predict_batch(&specialised, &input, specialised_labels);
+        Matrix *b = network_predict_batch(&generic, &input, generic_labels);
+
+        for (int i = 0; i < a->width * a->height; i++)
+            error = MAX(error, fabs(a->values[i] - b->values[i]));
+    }
+
+    const int failed = test_report(check, error, TEST_FORWARD_TOLERANCE);
+
+    matrix_free(input);
+    predictor_free(specialised);
+    predictor_free(generic);
+    network_free(network);
+
+    return failed;
+}
+
+/**
+ * @brief Take two steps with an optimizer from the values {1, -2} with the gradient {4, -2} scaled by 0.5, a step size
+ * of 0.1 and a momentum of 0.9, checking the values after each step. Two steps are taken so that the optimizer's state
+ * from the first step is used.
+ *
+ * @param type kind of optimizer.
+ * @param expected values expected after each step.
+ * @return 1 if the check failed, otherwise 0.
+ */
+int test_optimizer(Optimizer_Type type, const double expected[2][2])
+{
+    Optimizer optimizer = optimizer_malloc(type, 0.9, 2);
+    Vector values = vector_malloc(2);
+    Vector gradient = vector_malloc(2);
+    values.values[0] = 1;
+    values.values[1] = -2;
+    gradient.values[0] = 4;
+    gradient.values[1] = -2;
+
+    double error = 0;
+    for (int step = 0; step < 2; step++)
+    {
+        optimizer_step(&optimizer, &values, &gradient, 0.5, 0.1);
+        for (int i = 0; i < 2; i++)
+            error = MAX(error, fabs(values.values[i] - expected[step][i]));
+    }
+
+    char check[64];
+    snprintf(check, sizeof(check), "optimizer %s", optimizer_type_name(type));
+    const int failed = test_report(check, error, TEST_OPTIMIZER_TOLERANCE);
+
+    vector_free(values);
+    vector_free(gradient);
+    optimizer_free(optimizer);
+
+    return failed;
+}
+
+/**
+ * @brief Save a network and load it back, checking that nothing changes, and that a truncated copy of the file is
+ * rejected.
+ *
+ * @return number of failed checks.
+ */
+int test_model()
+{
+    int sizes[4] = {12, 7, 5, 4};
+
+    Rng rng = rnd_create(TEST_SEED);
+    Neural_Net network = test_network_malloc(4, sizes, OUTPUT_SOFTMAX, &rng);
+
+    char file[] = "/tmp/test_network_XXXXXX";
+    int fd = mkstemp(file);
+    if (fd < 0 || network_save(&network, file) != 0)
+    {
+        printf("FAIL model (could not save to %s)\n", file);
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(file);
+        }
+        network_free(network);
+        return 1;
+    }
+
+    int failed = 0;
+    Neural_Net *loaded = network_load(file);
+    if (!loaded)
+    {
+        printf("FAIL model round trip (could not load %s)\n", file);
+        failed++;
+    }
+    else
+    {
+        int same = loaded->layers == network.layers && loaded->output == network.output &&
+                   loaded->total_values == network.total_values;
+        for (int i = 0; same && i < network.layers; i++)
+            same = loaded->weights[i].width == network.weights[i].width &&
+                   loaded->weights[i].height == network.weights[i].height &&
+                   loaded->biases[i].size == network.biases[i].size;
+        same = same && memcmp(loaded->values, network.values, sizeof(real) * network.total_values) == 0;
+
+        printf("%s model round trip\n", same ? "PASS" : "FAIL");
+        failed += !same;
+        network_free_p(loaded);
+    }
+
+    // Drop the last value, which must be noticed from the size of the file
+    off_t size = lseek(fd, 0, SEEK_END);
+    Neural_Net *truncated = 0;
+    if (size > 0 && ftruncate(fd, size - sizeof(real)) == 0)
+        truncated = network_load(file);
+    printf("%s model truncated\n", truncated ? "FAIL" : "PASS");
+    failed += truncated != 0;
+    if (truncated)
+        network_free_p(truncated);
+
+    close(fd);
+    unlink(file);
+    network_free(network);
+
+    return failed;
+}
+
+/**
+ * @brief Train two networks from the same starting values in deterministic mode with the same number of threads,
+ * checking that they end up identical.
+ *
+ * @return number of failed checks.
+ */
+int test_deterministic()
+{
+    const int THREADS = 3;
+    int sizes[4] = {TEST_IMAGE_SIDE * TEST_IMAGE_SIDE, 16, 16, TEST_CLASSES};
+
+    Rng rng = rnd_create(TEST_SEED);
+    Dataset *dataset = test_dataset_malloc(TEST_DATASET_COUNT, &rng);
+    if (!dataset)
+    {
+        printf("FAIL deterministic (could not write and load a dataset)\n");
+        return 1;
+    }
+
+    Neural_Net a = test_network_malloc(4, sizes, OUTPUT_SIGMOID, &rng);
+    Neural_Net b = network_malloc(4, sizes);
+    memcpy(b.values, a.values, sizeof(real) * a.total_values);
+
+    Train_Options options = train_options_default();
+    options.threads = THREADS;
+    options.deterministic = 1;
+    options.verbose = 0;
+    options.iterations = 2;
+    options.seed = TEST_SEED;
+
+    int trained = network_train(&a, dataset, &options) == 0 && network_train(&b, dataset, &options) == 0;
+    int same = trained && memcmp(a.values, b.values, sizeof(real) * a.total_values) == 0;
+    printf("%s deterministic threads=%i%s\n", same ? "PASS" : "FAIL", THREADS, trained ? "" : " (training failed)");
+
+    network_free(a);
+    network_free(b);
+    dataset_free_p(dataset);
+
+    return !same;
+}
+
+/**
+ * @brief Check that training on a sparsified dataset gives the same network as training on the dense dataset, and
+ * that the first layer inputs counted for the FLOP estimate are just the nonzero pixels.
+ *
+ * @return 1 if the check failed, otherwise 0.
+ */
+int test_sparse()
+{
+    int sizes[4] = {TEST_IMAGE_SIDE * TEST_IMAGE_SIDE, 16, 16, TEST_CLASSES};
+
+    // Both datasets are made from the same random state, so hold the same images
+    Rng rng = rnd_create(TEST_SEED);
+    Rng dense_rng = rng;
+    Dataset *dense = test_dataset_malloc(TEST_DATASET_COUNT, &dense_rng);
+    Dataset *sparse = test_dataset_malloc(TEST_DATASET_COUNT, &rng);
+    if (!dense || !sparse || dataset_sparsify(sparse) != 0)
+    {
+        printf("FAIL sparse (could not write and load a dataset)\n");
+        if (dense)
+            dataset_free_p(dense);
+        if (sparse)
+            dataset_free_p(sparse);
+        return 1;
+    }
+
+    Neural_Net a = test_network_malloc(4, sizes, OUTPUT_SIGMOID, &rng);
+    Neural_Net b = network_malloc(4, sizes);
+    memcpy(b.values, a.values, sizeof(real) * a.total_values);
+
+    Train_Options options = train_options_default();
+    options.threads = 1;
+    options.verbose = 0;
+    options.iterations = 2;
+    options.seed = TEST_SEED;
+
+    int failed = 0;
+    if (network_train(&a, dense, &options) != 0 || network_train(&b, sparse, &options) != 0)
+    {
+        printf("FAIL sparse (training failed)\n");
+        failed = 1;
+    }
+    else
+    {
+        double error = 0;
+        for (int i = 0; i < a.total_values; i++)
+            error = fmax(error, fabs(a.values[i] - b.values[i]));
+        failed += test_report("sparse training matches dense", error, TEST_FORWARD_TOLERANCE);
+    }
+
+    double nonzero = 0;
+    for (int i = 0; i < sparse->count; i++)
+        nonzero += dataset_image(sparse, i)->nonzero_count;
+
+    Optimize_Pool *pool = optimize_pool_start(&a, &options);
+    if (pool)
+    {
+        Train_Stats dense_stats = network_optimize(pool, &a, dense, 0, &options, 0, 0);
+        Train_Stats sparse_stats = network_optimize(pool, &a, sparse, 0, &options, 0, 0);
+        optimize_pool_stop(pool);
+        const int counted = dense_stats.inputs == (double)dense->count * sizes[0] && sparse_stats.inputs == nonzero;
+        printf("%s sparse inputs counted (dense %.0f, sparse %.0f of %.0f)\n", counted ? "PASS" : "FAIL",
+               dense_stats.inputs, sparse_stats.inputs, nonzero);
+        failed += !counted;
+    }
+    else
+    {
+        printf("FAIL sparse (could not start the optimize pool)\n");
+        failed++;
+    }
+
+    network_free(a);
+    network_free(b);
+    dataset_free_p(dense);
+    dataset_free_p(sparse);
+
+    return failed;
+}
+
+/**
+ * @brief Check that each pass over a stream returns every image of its files exactly once, with a shuffle buffer and
+ * segments smaller than the files so that both are refilled and the last segment is not full.
+ *
+ * @return number of failed checks.
+ */
+int test_stream()
+{
+    const int BUFFER_CAPACITY = 100;
+    const int SEGMENT_SIZE = 37;
+    const int PASSES = 2;
+
+    Rng rng = rnd_create(TEST_SEED);
+    char images[] = "/tmp/test_network_images_XXXXXX";
+    char labels[] = "/tmp/test_network_labels_XXXXXX";
+    if (test_write_dataset(images, labels, TEST_DATASET_COUNT, &rng) != 0)
+    {
+        printf("FAIL stream (could not write a dataset)\n");
+        return 1;
+    }
+    Dataset *dataset = image_load(images, labels);
+    Image_Stream *stream = stream_open(images, labels, BUFFER_CAPACITY);
+    unlink(images);
+    unlink(labels);
+    if (!dataset || !stream)
+    {
+        printf("FAIL stream (could not load the dataset or open the stream)\n");
+        if (dataset)
+            dataset_free_p(dataset);
+        if (stream)
+            stream_close(stream);
+        return 1;
+    }
+    stream->classes = TEST_CLASSES;
+
+    Dataset *segment = stream_dataset_malloc(stream, SEGMENT_SIZE);
+    int *visits = malloc(sizeof(int) * dataset->count);
+    int failed = 0;
+    for (int pass = 0; pass < PASSES; pass++)
+    {
+        memset(visits, 0, sizeof(int) * dataset->count);
+        int read = 0, unknown = 0;
+        int res = stream_rewind(stream, &rng);
+        while (res == 0)
+        {
+            const int count = stream_read(stream, segment, SEGMENT_SIZE);
+            if (count < 0)
+                res = -1;
+            for (int n = 0; n < count; n++)
+            {
+                // Match each image to the first image of the files with the same pixels and label not yet visited
+                const Image *image = dataset_image(segment, n);
+                int match = -1;
+                for (int i = 0; i < dataset->count && match < 0; i++)
+                {
+                    const Image *other = dataset_image(dataset, i);
+                    if (!visits[i] && other->label == image->label &&
+                        memcmp(other->data, image->data, image->size) == 0)
+                        match = i;
+                }
+                if (match >= 0)
+                    visits[match]++;
+                unknown += match < 0;
+            }
+            read += MAX(count, 0);
+            if (count < SEGMENT_SIZE)
+                break;
+        }
+
+        int missed = 0;
+        for (int i = 0; i < dataset->count; i++)
+            missed += visits[i] != 1;
+        const int passed = res == 0 && read == dataset->count && unknown == 0 && missed == 0;
+        printf("%s stream pass %i (read %i of %i, %i unknown, %i missed)%s\n", passed ? "PASS" : "FAIL", pass + 1,
+               read, dataset->count, unknown, missed, res == 0 ? "" : " (stream could not be read)");
+        failed += !passed;
+    }
+
+    free(visits);
+    dataset_free_p(segment);
+    stream_close(stream);
+    dataset_free_p(dataset);
+
+    return failed;
+}
+
+int main()
+{
+    kernel_init();
+
+    int failed = 0;
+    failed += test_gradient(OUTPUT_SIGMOID, "sigmoid");
+    failed += test_gradient(OUTPUT_SOFTMAX, "softmax");
+    failed += test_topology(OUTPUT_SIGMOID, "sigmoid");
+    failed += test_topology(OUTPUT_SOFTMAX, "softmax");
+    // With the scaled gradient g = {2, -1}:
+    // momentum: m = {2, -1}, then m = 0.9 * m + g = {3.8, -1.9}, moving by 0.1 * m each step
+    // Nesterov: the same m, moving by 0.1 * (g + 0.9 * m), which is {0.38, -0.19} then {0.542, -0.271}
+    // Adam: a constant gradient moves each value by the step size, less a little for epsilon
+    const double momentum[2][2] = {{0.8, -1.9}, {0.42, -1.71}};
+    const double nesterov[2][2] = {{0.62, -1.81}, {0.078, -1.539}};
+    const double adam[2][2] = {{0.9000000158113858, -1.9000000316227665}, {0.8000000269945212, -1.8000000539890344}};
+    failed += test_optimizer(OPTIMIZER_MOMENTUM, momentum);
+    failed += test_optimizer(OPTIMIZER_NESTEROV, nesterov);
+    failed += test_optimizer(OPTIMIZER_ADAM, adam);
+    failed += test_model();
+    failed += test_deterministic();
+    failed += test_sparse();
+    failed += test_stream();
+
+    printf("%i failed\n", failed);
+
+    return failed;
+}
\ No newline at end of file